@@ -0,0 +1,149 @@
+/*
+ *  chirc: a simple multi-threaded IRC server
+ *
+ *  Account store
+ *
+ *  see accounts.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <crypt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "accounts.h"
+#include "log.h"
+
+typedef struct account_store {
+    const account_store_header *header;
+    const account *slots;
+    size_t size;
+} account_store;
+
+static _Atomic(account_store *) current_store = NULL;
+
+static char irc_tolower(char c)
+{
+    /* In RFC 1459, {}|^ are the lower case versions of []\~ */
+    if (c >= 'A' && c <= '^')
+        return c + ('a' - 'A');
+    return c;
+}
+
+bool account_casefold(char *dst, chistr name)
+{
+    if (name.len == 0 || name.len > ACCOUNT_NAME_MAX)
+        return false;
+
+    for (size_t i = 0; i < name.len; i++)
+        dst[i] = irc_tolower(name.s[i]);
+    dst[name.len] = '\0';
+    return true;
+}
+
+uint64_t account_name_hash(const char *folded)
+{
+    /* FNV-1a */
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (; *folded != '\0'; folded++) {
+        hash ^= (unsigned char) *folded;
+        hash *= 1099511628211ULL;
+    }
+    return hash != 0 ? hash : 1;
+}
+
+int account_store_load(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        chilog(WARNING, "Could not open account store %s", path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < sizeof(account_store_header)) {
+        chilog(WARNING, "Account store %s is truncated", path);
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        chilog(WARNING, "Could not map account store %s", path);
+        return -1;
+    }
+
+    const account_store_header *header = map;
+    if (memcmp(header->magic, ACCOUNTS_MAGIC, sizeof(header->magic)) != 0
+            || header->version != ACCOUNTS_VERSION
+            || header->num_slots == 0 || (header->num_slots & (header->num_slots - 1)) != 0
+            || st.st_size < sizeof(account_store_header) + (size_t) header->num_slots * sizeof(account)) {
+        chilog(WARNING, "Account store %s is invalid", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    /* Account names are copied into ACCOUNT_NAME_MAX + 1 byte buffers,
+     * and both strings are used with str*() functions */
+    const account *slots = (const account *) (header + 1);
+    for (uint32_t i = 0; i < header->num_slots; i++) {
+        if (slots[i].hash != 0
+                && (memchr(slots[i].name, '\0', ACCOUNT_NAME_MAX + 1) == NULL
+                    || memchr(slots[i].password_hash, '\0', sizeof(slots[i].password_hash)) == NULL)) {
+            chilog(WARNING, "Account store %s is invalid (slot %u)", path, i);
+            munmap(map, st.st_size);
+            return -1;
+        }
+    }
+
+    account_store *store = malloc(sizeof(account_store));
+    store->header = header;
+    store->slots = slots;
+    store->size = st.st_size;
+
+    /* The previous store is deliberately not unmapped (see accounts.h) */
+    atomic_store_explicit(&current_store, store, memory_order_release);
+    chilog(INFO, "Loaded %u accounts from %s", header->num_accounts, path);
+    return 0;
+}
+
+const account *account_lookup(chistr name)
+{
+    account_store *store = atomic_load_explicit(&current_store, memory_order_acquire);
+    char folded[ACCOUNT_NAME_MAX + 1];
+
+    if (store == NULL || !account_casefold(folded, name))
+        return NULL;
+
+    uint64_t hash = account_name_hash(folded);
+    uint32_t mask = store->header->num_slots - 1;
+    for (uint32_t i = hash & mask, probes = 0; probes <= mask; i = (i + 1) & mask, probes++) {
+        const account *a = &store->slots[i];
+        if (a->hash == 0)
+            return NULL;
+        if (a->hash == hash && strncmp(a->name, folded, sizeof(a->name)) == 0)
+            return a;
+    }
+    return NULL;
+}
+
+bool account_check_password(const account *a, const char *password)
+{
+    struct crypt_data data;
+    char stored[ACCOUNT_HASH_MAX];
+
+    memcpy(stored, a->password_hash, sizeof(stored));
+    stored[sizeof(stored) - 1] = '\0';
+
+    memset(&data, 0, sizeof(data));
+    const char *hashed = crypt_r(password, stored, &data);
+    return hashed != NULL && hashed[0] != '*' && strcmp(hashed, stored) == 0;
+}
@@ -0,0 +1,113 @@
+/*
+ *
+ *  chirc: a simple multi-threaded IRC server
+ *
+ *  Account store
+ *
+ *  Registered nicks (accounts) are kept in a file that the server
+ *  mmap()s read-only. The file is an open-addressing hash table keyed
+ *  by the case-folded account name, so checking a login during
+ *  registration is a local memory lookup.
+ *
+ *  The server never writes to the file. Updates (see chirc-accounts)
+ *  write a complete new table to a temporary file and rename() it over
+ *  the old one, and the server maps the new table when it is told to
+ *  reload (SIGHUP). Lookups read the current table through a single
+ *  atomic pointer and take no locks. Tables replaced by a reload stay
+ *  mapped, since a lookup may still be reading them; reloads are rare,
+ *  so this costs little.
+ *
+ */
+
+#ifndef CHIRC_ACCOUNTS_H_
+#define CHIRC_ACCOUNTS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chistr.h"
+
+#define ACCOUNTS_MAGIC "CHIRCACC"
+#define ACCOUNTS_VERSION (1)
+
+#define ACCOUNT_NAME_MAX (32)
+#define ACCOUNT_HASH_MAX (128)
+#define ACCOUNT_PASSWORD_MAX (64)       /* Longest password accepted with PASS */
+
+typedef struct account_store_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_slots;         /* Always a power of two */
+    uint32_t num_accounts;
+    uint32_t reserved;
+} account_store_header;
+
+/* A slot of the table. Empty slots have hash 0 */
+typedef struct account {
+    uint64_t hash;
+    char name[ACCOUNT_NAME_MAX + 8];            /* Case-folded, NUL-terminated */
+    char password_hash[ACCOUNT_HASH_MAX];       /* crypt(3) hash, NUL-terminated */
+    int64_t registered;                         /* When the account was registered */
+    uint64_t flags;
+} account;
+
+
+/*
+ * account_casefold - Case-folds an account name (RFC 1459 case mapping)
+ *
+ * dst: Where to store the NUL-terminated result. Must have space for
+ *      ACCOUNT_NAME_MAX + 1 bytes.
+ *
+ * name: The name
+ *
+ * Returns: false if the name is empty or longer than ACCOUNT_NAME_MAX.
+ */
+bool account_casefold(char *dst, chistr name);
+
+
+/*
+ * account_name_hash - Hashes a case-folded account name
+ *
+ * Returns: the hash, which is never 0.
+ */
+uint64_t account_name_hash(const char *folded);
+
+
+/*
+ * account_store_load - Maps an account store and makes it current
+ *
+ * path: Path of the account store
+ *
+ * Returns: 0 on success, -1 if the file is missing or invalid (the
+ *          current store, if any, is kept). A store is invalid if any
+ *          account's name is longer than ACCOUNT_NAME_MAX or its
+ *          password hash is not NUL-terminated.
+ */
+int account_store_load(const char *path);
+
+
+/*
+ * account_lookup - Looks up an account in the current store
+ *
+ * name: Account name (not case-folded)
+ *
+ * Returns: the account, or NULL if there is no such account (or no
+ *          store is loaded). The account stays valid until the process
+ *          exits.
+ */
+const account *account_lookup(chistr name);
+
+
+/*
+ * account_check_password - Checks a password against an account
+ *
+ * This hashes the password with the account's crypt(3) settings, which
+ * is deliberately slow.
+ *
+ * Returns: true if the password is correct.
+ */
+bool account_check_password(const account *a, const char *password);
+
+
+#endif /* CHIRC_ACCOUNTS_H_ */
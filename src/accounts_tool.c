@@ -0,0 +1,169 @@
+/*
+ *
+ *  chirc: a simple multi-threaded IRC server
+ *
+ *  chirc-accounts: manages the account store used by chirc -a.
+ *
+ *  Usage: chirc-accounts FILE add NAME      (reads the password from stdin)
+ *         chirc-accounts FILE remove NAME
+ *         chirc-accounts FILE list
+ *
+ *  Every update writes a complete new table to FILE.tmp and renames it
+ *  over FILE, so a running server never sees a partially written store.
+ *  Send SIGHUP to the server to make it load the new table.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <crypt.h>
+
+#include "accounts.h"
+
+// Reads all the accounts in the store at path (if it exists) into *accounts
+int read_accounts(const char *path, account **accounts) {
+    FILE *f = fopen(path, "r");
+    *accounts = NULL;
+    if (f == NULL) {
+        return 0;
+    }
+
+    account_store_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, ACCOUNTS_MAGIC, sizeof(header.magic)) != 0
+            || header.version != ACCOUNTS_VERSION) {
+        fprintf(stderr, "ERROR: %s is not a valid account store\n", path);
+        exit(-1);
+    }
+
+    int num_accounts = 0;
+    *accounts = malloc((header.num_accounts + 1) * sizeof(account));
+    for (uint32_t i = 0; i < header.num_slots; i++) {
+        account a;
+        if (fread(&a, sizeof(a), 1, f) != 1) {
+            fprintf(stderr, "ERROR: %s is truncated\n", path);
+            exit(-1);
+        }
+        if (a.hash != 0 && num_accounts < header.num_accounts) {
+            (*accounts)[num_accounts++] = a;
+        }
+    }
+    fclose(f);
+    return num_accounts;
+}
+
+// Writes a new store with the given accounts, and atomically replaces the old one
+void write_accounts(const char *path, account *accounts, int num_accounts) {
+    uint32_t num_slots = 16;
+    while (num_slots < 2 * num_accounts) {
+        num_slots *= 2;
+    }
+
+    account *slots = calloc(num_slots, sizeof(account));
+    for (int i = 0; i < num_accounts; i++) {
+        uint32_t slot = accounts[i].hash & (num_slots - 1);
+        while (slots[slot].hash != 0) {
+            slot = (slot + 1) & (num_slots - 1);
+        }
+        slots[slot] = accounts[i];
+    }
+
+    account_store_header header = {
+        .magic = ACCOUNTS_MAGIC,
+        .version = ACCOUNTS_VERSION,
+        .num_slots = num_slots,
+        .num_accounts = num_accounts
+    };
+
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *f = fopen(tmp_path, "w");
+    if (f == NULL || fwrite(&header, sizeof(header), 1, f) != 1
+            || fwrite(slots, sizeof(account), num_slots, f) != num_slots
+            || fflush(f) != 0 || fsync(fileno(f)) != 0 || fclose(f) != 0
+            || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "ERROR: Could not write %s\n", path);
+        exit(-1);
+    }
+    free(slots);
+}
+
+int find_account(account *accounts, int num_accounts, const char *folded) {
+    for (int i = 0; i < num_accounts; i++) {
+        if (strcmp(accounts[i].name, folded) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3 || (strcmp(argv[2], "list") != 0 && argc < 4)) {
+        fprintf(stderr, "Usage: chirc-accounts FILE (add NAME | remove NAME | list)\n");
+        exit(-1);
+    }
+
+    const char *path = argv[1], *command = argv[2];
+    account *accounts;
+    int num_accounts = read_accounts(path, &accounts);
+
+    if (strcmp(command, "list") == 0) {
+        for (int i = 0; i < num_accounts; i++) {
+            printf("%s\n", accounts[i].name);
+        }
+        return 0;
+    }
+
+    char folded[ACCOUNT_NAME_MAX + 1];
+    if (!account_casefold(folded, chistr_make(argv[3], strlen(argv[3])))) {
+        fprintf(stderr, "ERROR: Account names must be 1 to %i characters long\n", ACCOUNT_NAME_MAX);
+        exit(-1);
+    }
+    int index = find_account(accounts, num_accounts, folded);
+
+    if (strcmp(command, "add") == 0) {
+        char password[256];
+        if (fgets(password, sizeof(password), stdin) == NULL) {
+            fprintf(stderr, "ERROR: Expected the password on stdin\n");
+            exit(-1);
+        }
+        password[strcspn(password, "\r\n")] = '\0';
+        if (strlen(password) > ACCOUNT_PASSWORD_MAX) {
+            fprintf(stderr, "ERROR: Passwords must be at most %i characters long\n", ACCOUNT_PASSWORD_MAX);
+            exit(-1);
+        }
+
+        const char *hashed = crypt(password, crypt_gensalt(NULL, 0, NULL, 0));
+        if (hashed == NULL || hashed[0] == '*' || strlen(hashed) >= ACCOUNT_HASH_MAX) {
+            fprintf(stderr, "ERROR: Could not hash the password\n");
+            exit(-1);
+        }
+
+        if (index == -1) {
+            accounts = realloc(accounts, (num_accounts + 1) * sizeof(account));
+            index = num_accounts++;
+        }
+        account *a = &accounts[index];
+        memset(a, 0, sizeof(account));
+        strcpy(a->name, folded);
+        strcpy(a->password_hash, hashed);
+        a->hash = account_name_hash(folded);
+        a->registered = time(NULL);
+    } else if (strcmp(command, "remove") == 0) {
+        if (index == -1) {
+            fprintf(stderr, "ERROR: No such account: %s\n", argv[3]);
+            exit(-1);
+        }
+        accounts[index] = accounts[--num_accounts];
+    } else {
+        fprintf(stderr, "ERROR: Unknown command %s\n", command);
+        exit(-1);
+    }
+
+    write_accounts(path, accounts, num_accounts);
+    free(accounts);
+    return 0;
+}
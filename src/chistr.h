@@ -0,0 +1,79 @@
+/*
+ *
+ *  chirc: a simple multi-threaded IRC server
+ *
+ *  Length-carrying strings
+ *
+ *  A chistr is a pointer and a length. It is used for everything that
+ *  is parsed out of, or written to, a connection, so that no code ever
+ *  has to scan a string for its terminator or copy it just to add one.
+ *
+ *  A chistr either borrows its bytes (e.g. a slice of the line being
+ *  parsed, only valid while that line is being processed) or owns them
+ *  (allocated by chistr_dup, released with chistr_free). Owned strings
+ *  are also NUL-terminated, but code should not rely on it.
+ *
+ */
+
+#ifndef CHIRC_CHISTR_H_
+#define CHIRC_CHISTR_H_
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+typedef struct chistr {
+    const char *s;
+    size_t len;
+} chistr;
+
+/* The empty / unset string */
+#define CHISTR_NULL ((chistr) {NULL, 0})
+
+/* A chistr for a string literal, with its length computed at compile time */
+#define CHISTR_LIT(lit) ((chistr) {(lit), sizeof(lit) - 1})
+
+/* printf support: printf("%.*s", CHISTR_FMT(str)) */
+#define CHISTR_FMT(str) (int) (str).len, (str).s
+
+static inline chistr chistr_make(const char *s, size_t len)
+{
+    return (chistr) {s, len};
+}
+
+static inline bool chistr_isnull(chistr str)
+{
+    return str.s == NULL;
+}
+
+static inline bool chistr_eq(chistr a, chistr b)
+{
+    return a.len == b.len && memcmp(a.s, b.s, a.len) == 0;
+}
+
+static inline bool chistr_caseeq(chistr a, chistr b)
+{
+    return a.len == b.len && strncasecmp(a.s, b.s, a.len) == 0;
+}
+
+/* Returns an owned copy of str (CHISTR_NULL if str is CHISTR_NULL) */
+static inline chistr chistr_dup(chistr str)
+{
+    if (str.s == NULL)
+        return CHISTR_NULL;
+
+    char *copy = malloc(str.len + 1);
+    memcpy(copy, str.s, str.len);
+    copy[str.len] = '\0';
+    return (chistr) {copy, str.len};
+}
+
+/* Releases a string returned by chistr_dup */
+static inline void chistr_free(chistr *str)
+{
+    free((char *) str->s);
+    *str = CHISTR_NULL;
+}
+
+#endif /* CHIRC_CHISTR_H_ */
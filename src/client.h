@@ -1,9 +1,71 @@
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "chistr.h"
+#include "outbuf.h"
+#include "ident.h"
+#include "accounts.h"
+
+// IRC messages are at most 512 bytes, including the CRLF
+#define MAX_MESSAGE_LENGTH 512
+
+// Deliveries whose latency is recorded once the output buffer is flushed
+#define MAX_PENDING_DELIVERIES 16
 
 typedef struct client {
     int sockfd;
-    char *nick;
-    char *username;
-    char *fullName;
+    chistr nick;        // Owned, CHISTR_NULL until NICK is received
+    chistr username;    // Owned, CHISTR_NULL until USER is received
+    chistr fullName;    // Owned, CHISTR_NULL until USER is received
     bool welcomeMessageSent;
+    bool logTrace;                      // Log everything about this connection
+    unsigned int logTraceGeneration;    // Trace generation logTrace was computed for
+    struct timespec readRxTime;         // When the kernel received the data of the last read
+    struct timespec partialRxTime;      // When the kernel received the start of the buffered partial line
+    struct timespec lineRxTime;         // When the kernel received the line being processed
+    outbuf out;                         // Data waiting to be written to the client
+    struct timespec pendingRxTimes[MAX_PENDING_DELIVERIES];
+    int numPendingDeliveries;
+    long coalesceWindowUs;              // How long output may wait for more replies (0: flush immediately)
+    struct timespec flushDeadline;      // When the queued output must be flushed at the latest
+    int coalescedReads;                 // Reads whose replies are queued in out
+    chistr initialData;                 // Owned, data received after USER/NICK before the client thread started
+    char account[ACCOUNT_NAME_MAX + 1]; // Account logged in to (case-folded), empty if none
 } client;
+
+#define MAX_NICK_LENGTH 32
+#define MAX_USERNAME_LENGTH 32
+#define MAX_FULLNAME_LENGTH 128
+
+// Password check of a pending client whose nick is a registered account
+typedef enum {
+    AUTH_NONE,          // Not started (or not needed)
+    AUTH_RUNNING,       // Queued or running on the auth worker pool
+    AUTH_PASSED,
+    AUTH_FAILED
+} auth_state_t;
+
+// A connection that has not registered yet. Most hostile or broken connections never get
+// past this, so it is kept small, and no thread or client record is created for it
+typedef struct pending_client {
+    int sockfd;
+    int lineUsed;
+    char line[MAX_MESSAGE_LENGTH];
+    char nick[MAX_NICK_LENGTH + 1];
+    char username[MAX_USERNAME_LENGTH + 1];
+    char fullName[MAX_FULLNAME_LENGTH + 1];
+    char password[ACCOUNT_PASSWORD_MAX + 1];    // From PASS, checked if the nick is a registered account
+    char account[ACCOUNT_NAME_MAX + 1];         // Account logged in to (case-folded), empty if none
+    struct timespec rxTime;             // When the last read returned
+    uint32_t addr;                      // Peer IPv4 address, network byte order
+    auth_state_t authState;
+    struct timespec registrationDeadline;   // CLOCK_MONOTONIC, when the connection is dropped if still pending
+    bool registering;                   // NICK and USER received, waiting for ident and / or auth
+    int identFd;                        // Ident query socket, -1 if no query is in progress
+    bool identQuerySent;
+    struct timespec identDeadline;      // CLOCK_MONOTONIC, when the ident query is abandoned
+    int identUsed;
+    char identReply[IDENT_REPLY_MAX];
+    char ident[MAX_USERNAME_LENGTH + 1];    // User id from ident, empty if there is none
+} pending_client;
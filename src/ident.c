@@ -0,0 +1,104 @@
+/*
+ *  chirc: a simple multi-threaded IRC server
+ *
+ *  Ident (RFC 1413) queries
+ *
+ *  see ident.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "ident.h"
+
+int ident_connect(int sockfd)
+{
+    struct sockaddr_in local, peer;
+    socklen_t local_len = sizeof(local), peer_len = sizeof(peer);
+
+    if (getsockname(sockfd, (struct sockaddr *) &local, &local_len) == -1
+        || getpeername(sockfd, (struct sockaddr *) &peer, &peer_len) == -1)
+        return -1;
+
+    int identfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (identfd == -1)
+        return -1;
+
+    local.sin_port = 0;
+    peer.sin_port = htons(IDENT_PORT);
+    if (bind(identfd, (struct sockaddr *) &local, sizeof(local)) == -1
+        || (connect(identfd, (struct sockaddr *) &peer, sizeof(peer)) == -1 && errno != EINPROGRESS)) {
+        close(identfd);
+        return -1;
+    }
+    return identfd;
+}
+
+int ident_send_query(int identfd, int sockfd)
+{
+    struct sockaddr_in local, peer;
+    socklen_t local_len = sizeof(local), peer_len = sizeof(peer);
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+
+    if (getsockopt(identfd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1 || error != 0)
+        return -1;
+    if (getsockname(sockfd, (struct sockaddr *) &local, &local_len) == -1
+        || getpeername(sockfd, (struct sockaddr *) &peer, &peer_len) == -1)
+        return -1;
+
+    /* The query is tiny, so it always fits in the socket buffer of a new connection */
+    char query[32];
+    int len = snprintf(query, sizeof(query), "%u , %u\r\n", ntohs(peer.sin_port), ntohs(local.sin_port));
+    return send(identfd, query, len, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+/* Returns the next ':'-separated field of s, with surrounding spaces trimmed */
+static chistr next_field(chistr *s)
+{
+    const char *end = memchr(s->s, ':', s->len);
+    size_t len = end != NULL ? (size_t) (end - s->s) : s->len;
+    chistr field = chistr_make(s->s, len);
+
+    *s = end != NULL ? chistr_make(end + 1, s->len - len - 1) : chistr_make(s->s + len, 0);
+    while (field.len > 0 && (field.s[0] == ' ' || field.s[0] == '\t')) {
+        field.s++;
+        field.len--;
+    }
+    while (field.len > 0 && (field.s[field.len - 1] == ' ' || field.s[field.len - 1] == '\t'))
+        field.len--;
+    return field;
+}
+
+bool ident_parse_reply(chistr reply, char *user, size_t size)
+{
+    next_field(&reply);     /* Port pair */
+    if (!chistr_caseeq(next_field(&reply), CHISTR_LIT("USERID")))
+        return false;
+    next_field(&reply);     /* Operating system[, charset] */
+
+    /* The user id is the rest of the line, and may itself contain ':' */
+    chistr id = reply;
+    while (id.len > 0 && id.s[0] == ' ') {
+        id.s++;
+        id.len--;
+    }
+    if (id.len == 0 || size == 0)
+        return false;
+
+    /* Keeps only what is safe in a nick!user@host prefix */
+    size_t len = 0;
+    for (size_t i = 0; i < id.len && len < size - 1; i++) {
+        char ch = id.s[i];
+        if (ch == ' ' || ch == '@' || ch == '!' || ch == '\r' || ch == '\n' || ch == '\0')
+            break;
+        user[len++] = ch;
+    }
+    user[len] = '\0';
+    return len > 0;
+}
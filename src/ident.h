@@ -0,0 +1,77 @@
+/*
+ *
+ *  chirc: a simple multi-threaded IRC server
+ *
+ *  Ident (RFC 1413) queries
+ *
+ *  When a client connects, the server can ask the ident service on the
+ *  client's host (TCP port 113) who owns the connection:
+ *
+ *    -> <client port> , <server port>
+ *    <- <client port> , <server port> : USERID : <os> : <user id>
+ *
+ *  Many hosts drop port 113 rather than refuse it, so the queries are
+ *  non-blocking, and the caller must give up on them after a deadline.
+ *  These functions only do the socket and protocol work; polling the
+ *  query socket and enforcing the deadline is up to the caller.
+ *
+ */
+
+#ifndef CHIRC_IDENT_H_
+#define CHIRC_IDENT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "chistr.h"
+
+#define IDENT_PORT 113
+
+/* Longest ident reply that is parsed, CRLF included */
+#define IDENT_REPLY_MAX 128
+
+
+/*
+ * ident_connect - Starts connecting to the ident service of a client
+ *
+ * The query socket is bound to the address the client connected to, so
+ * the ident service sees the same server address as in its connection
+ * table.
+ *
+ * sockfd: Socket of the client connection
+ *
+ * Returns: a non-blocking socket whose connection is in progress (poll it
+ *          for POLLOUT, then call ident_send_query), or -1 on error.
+ */
+int ident_connect(int sockfd);
+
+
+/*
+ * ident_send_query - Sends the query once the connection is established
+ *
+ * identfd: Socket returned by ident_connect
+ *
+ * sockfd: Socket of the client connection
+ *
+ * Returns: 0 on success, -1 if the connection failed or the query could
+ *          not be sent.
+ */
+int ident_send_query(int identfd, int sockfd);
+
+
+/*
+ * ident_parse_reply - Extracts the user id from an ident reply
+ *
+ * reply: The reply line, without the CRLF
+ *
+ * user: Buffer for the user id
+ *
+ * size: Size of user. Longer user ids are truncated.
+ *
+ * Returns: true if the reply is a USERID reply, false otherwise (e.g. an
+ *          ERROR reply, or garbage).
+ */
+bool ident_parse_reply(chistr reply, char *user, size_t size);
+
+
+#endif /* CHIRC_IDENT_H_ */
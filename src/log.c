@@ -41,33 +41,445 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include "log.h"
 
-/* Logging level. Set by default to print just informational messages */
-static int loglevel = INFO;
+#define ALL_SUBSYS ((1u << LOG_NUM_SUBSYS) - 1)
 
+/* Logging level masks. Set by default to print just informational messages */
+atomic_uint __chirc_logmask[TRACE / 10 + 1] = {
+    ALL_SUBSYS, ALL_SUBSYS, ALL_SUBSYS, ALL_SUBSYS, ALL_SUBSYS, 0, 0
+};
+
+static const char *subsys_names[LOG_NUM_SUBSYS] = {
+    "general", "net", "parse", "channel", "link"
+};
+
+/* Everything below is protected by logconf_lock. The masks above are
+ * only written with the lock held, but can be read without it */
+static pthread_mutex_t logconf_lock = PTHREAD_MUTEX_INITIALIZER;
+static loglevel_t subsys_levels[LOG_NUM_SUBSYS] = {INFO, INFO, INFO, INFO, INFO};
+static char **trace_nicks = NULL;
+static int num_trace_nicks = 0;
+static atomic_uint trace_generation = 0;
+
+/* Sampling rate of chilog_sampled() */
+static atomic_uint sample_rate = 1;
+
+/* Log files. When logdir is set, long-lived threads (see
+ * chirc_logthread_dedicated) append to their own file through a private
+ * buffer. Every other thread is assigned one of LOGBUF_SHARED_SINKS
+ * shared buffers, so the number of files and buffers does not grow
+ * with the number of clients. A buffer's lock is only contended by the
+ * threads sharing it and by chirc_logflush_idle() */
+typedef struct logbuf {
+    pthread_mutex_t lock;
+    int fd;
+    size_t used;
+    time_t last_flush;
+    time_t stamp_sec;           /* Second that stamp was formatted for */
+    char stamp[24];             /* "[YYYY-MM-DD HH:MM:SS" */
+    struct logbuf *next;
+    char data[LOGBUF_SIZE];
+} logbuf_t;
+
+static char *logdir = NULL;
+static atomic_uint logbuf_count = 0;
+static pthread_key_t logbuf_key;
+static _Thread_local logbuf_t *thread_logbuf = NULL;
+static _Thread_local bool thread_dedicated = false;
+
+/* All the buffers, for chirc_logflush_idle(), and the shared ones. Shared
+ * buffers are created on first use and live until the process exits */
+static pthread_mutex_t logbufs_lock = PTHREAD_MUTEX_INITIALIZER;
+static logbuf_t *logbufs = NULL;
+static logbuf_t *shared_logbufs[LOGBUF_SHARED_SINKS];
+static atomic_uint next_shared_logbuf = 0;
+
+/* Rebuilds the per-level masks from subsys_levels. Must be called
+ * with logconf_lock held */
+static void update_logmasks()
+{
+    for (int i = 0; i <= TRACE / 10; i++) {
+        unsigned int mask = 0;
+        for (int subsys = 0; subsys < LOG_NUM_SUBSYS; subsys++) {
+            if (i * 10 <= subsys_levels[subsys])
+                mask |= 1u << subsys;
+        }
+        atomic_store_explicit(&__chirc_logmask[i], mask, memory_order_relaxed);
+    }
+}
 
 void chirc_setloglevel(loglevel_t level)
 {
-    loglevel = level;
+    pthread_mutex_lock(&logconf_lock);
+    for (int subsys = 0; subsys < LOG_NUM_SUBSYS; subsys++)
+        subsys_levels[subsys] = level;
+    update_logmasks();
+    pthread_mutex_unlock(&logconf_lock);
 }
 
-/* This function does the actual logging and is called by chilog().
- * It has a va_list parameter instead of being a variadic function */
-void __chilog(loglevel_t level, char *fmt, va_list argptr)
+void chirc_setsubsysloglevel(logsubsys_t subsys, loglevel_t level)
 {
-    time_t t;
-    char buf[80], *levelstr;
+    pthread_mutex_lock(&logconf_lock);
+    subsys_levels[subsys] = level;
+    update_logmasks();
+    pthread_mutex_unlock(&logconf_lock);
+}
+
+void chirc_adjustloglevel(int steps)
+{
+    pthread_mutex_lock(&logconf_lock);
+    for (int subsys = 0; subsys < LOG_NUM_SUBSYS; subsys++) {
+        int level = subsys_levels[subsys] + steps * 10;
+        if (level < QUIET)
+            level = QUIET;
+        if (level > TRACE)
+            level = TRACE;
+        subsys_levels[subsys] = level;
+    }
+    update_logmasks();
+    pthread_mutex_unlock(&logconf_lock);
+}
+
+static int parse_loglevel(const char *str, loglevel_t *level)
+{
+    static const struct {
+        const char *name;
+        loglevel_t level;
+    } levels[] = {
+        {"QUIET", QUIET}, {"CRITICAL", CRITICAL}, {"ERROR", ERROR},
+        {"WARNING", WARNING}, {"INFO", INFO}, {"DEBUG", DEBUG}, {"TRACE", TRACE}
+    };
+
+    for (int i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        if (strcasecmp(str, levels[i].name) == 0) {
+            *level = levels[i].level;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int chirc_loadlogconf(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        chilog(WARNING, "Could not open log configuration file %s", path);
+        return -1;
+    }
+
+    loglevel_t levels[LOG_NUM_SUBSYS];
+    char **nicks = NULL;
+    int num_nicks = 0;
+    char line[256];
+
+    pthread_mutex_lock(&logconf_lock);
+    memcpy(levels, subsys_levels, sizeof(levels));
+    pthread_mutex_unlock(&logconf_lock);
+
+    for (int lineno = 1; fgets(line, sizeof(line), f) != NULL; lineno++) {
+        char *key = line, *value, *end;
+
+        while (isspace(*key))
+            key++;
+        end = key + strlen(key);
+        while (end > key && isspace(end[-1]))
+            *--end = '\0';
+        if (*key == '\0' || *key == '#')
+            continue;
+
+        value = strchr(key, '=');
+        if (value == NULL) {
+            chilog(WARNING, "%s:%i: expected key=value", path, lineno);
+            continue;
+        }
+        *value++ = '\0';
+
+        if (strcmp(key, "trace") == 0) {
+            nicks = realloc(nicks, (num_nicks + 1) * sizeof(char *));
+            nicks[num_nicks++] = strdup(value);
+            continue;
+        }
+
+        if (strcmp(key, "sample") == 0) {
+            chirc_setlogsampling(atoi(value));
+            continue;
+        }
+
+        loglevel_t level;
+        if (parse_loglevel(value, &level) == -1) {
+            chilog(WARNING, "%s:%i: unknown log level %s", path, lineno, value);
+            continue;
+        }
+
+        if (strcmp(key, "level") == 0) {
+            for (int subsys = 0; subsys < LOG_NUM_SUBSYS; subsys++)
+                levels[subsys] = level;
+            continue;
+        }
+
+        int subsys;
+        for (subsys = 0; subsys < LOG_NUM_SUBSYS; subsys++) {
+            if (strcmp(key, subsys_names[subsys]) == 0) {
+                levels[subsys] = level;
+                break;
+            }
+        }
+        if (subsys == LOG_NUM_SUBSYS)
+            chilog(WARNING, "%s:%i: unknown subsystem %s", path, lineno, key);
+    }
+    fclose(f);
+
+    pthread_mutex_lock(&logconf_lock);
+    memcpy(subsys_levels, levels, sizeof(levels));
+    update_logmasks();
+    for (int i = 0; i < num_trace_nicks; i++)
+        free(trace_nicks[i]);
+    free(trace_nicks);
+    trace_nicks = nicks;
+    num_trace_nicks = num_nicks;
+    atomic_fetch_add(&trace_generation, 1);
+    pthread_mutex_unlock(&logconf_lock);
+
+    chilog(INFO, "Loaded log configuration from %s (%i traced nicks)", path, num_nicks);
+    return 0;
+}
+
+void chirc_setlogsampling(unsigned int rate)
+{
+    atomic_store_explicit(&sample_rate, rate < 1 ? 1 : rate, memory_order_relaxed);
+}
+
+unsigned int chirc_logtrace_generation()
+{
+    return atomic_load_explicit(&trace_generation, memory_order_acquire);
+}
+
+bool chirc_logtrace_nick(const char *nick, size_t len)
+{
+    bool traced = false;
+
+    if (nick == NULL)
+        return false;
+
+    pthread_mutex_lock(&logconf_lock);
+    for (int i = 0; i < num_trace_nicks; i++) {
+        if (strlen(trace_nicks[i]) == len && strncasecmp(trace_nicks[i], nick, len) == 0) {
+            traced = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&logconf_lock);
+
+    return traced;
+}
+
+static void logbuf_flush(logbuf_t *lb)
+{
+    size_t written = 0;
+
+    while (written < lb->used) {
+        ssize_t n = write(lb->fd, lb->data + written, lb->used - written);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        written += n;
+    }
+    lb->used = 0;
+    lb->last_flush = time(NULL);
+}
+
+/* pthread_key destructor: flushes and frees the buffer of an exiting thread */
+static void logbuf_destroy(void *ptr)
+{
+    logbuf_t *lb = (logbuf_t *) ptr;
+
+    pthread_mutex_lock(&logbufs_lock);
+    for (logbuf_t **prev = &logbufs; *prev != NULL; prev = &(*prev)->next) {
+        if (*prev == lb) {
+            *prev = lb->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&logbufs_lock);
+
+    logbuf_flush(lb);
+    close(lb->fd);
+    pthread_mutex_destroy(&lb->lock);
+    free(lb);
+}
+
+int chirc_setlogdir(const char *dir)
+{
+    if (pthread_key_create(&logbuf_key, logbuf_destroy) != 0)
+        return -1;
+    logdir = strdup(dir);
+    return 0;
+}
+
+void chirc_logflush()
+{
+    if (thread_logbuf != NULL) {
+        pthread_mutex_lock(&thread_logbuf->lock);
+        logbuf_flush(thread_logbuf);
+        pthread_mutex_unlock(&thread_logbuf->lock);
+    }
+}
+
+void chirc_logflush_idle()
+{
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&logbufs_lock);
+    for (logbuf_t *lb = logbufs; lb != NULL; lb = lb->next) {
+        pthread_mutex_lock(&lb->lock);
+        if (lb->used > 0 && now - lb->last_flush >= LOGBUF_FLUSH_INTERVAL)
+            logbuf_flush(lb);
+        pthread_mutex_unlock(&lb->lock);
+    }
+    pthread_mutex_unlock(&logbufs_lock);
+}
+
+void chirc_logreset()
+{
+    /* Only the calling thread survives fork(). The buffers of the other
+     * threads, and the lock they may have held, belong to the parent */
+    pthread_mutex_init(&logbufs_lock, NULL);
+    for (logbuf_t *lb = logbufs, *next; lb != NULL; lb = next) {
+        next = lb->next;
+        close(lb->fd);
+        free(lb);
+    }
+    logbufs = NULL;
+    memset(shared_logbufs, 0, sizeof(shared_logbufs));
+    thread_logbuf = NULL;
+    if (logdir != NULL)
+        pthread_setspecific(logbuf_key, NULL);
+    atomic_store(&logbuf_count, 0);
+}
+
+void chirc_logthread_dedicated()
+{
+    if (!thread_dedicated)
+        thread_logbuf = NULL;   /* Stop using a shared buffer, if any */
+    thread_dedicated = true;
+}
+
+/* Opens a new log file and adds its buffer to the list. Must be called
+ * with logbufs_lock held */
+static logbuf_t *logbuf_create()
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/chirc-%d-%u.log", logdir, (int) getpid(),
+             atomic_fetch_add(&logbuf_count, 1));
 
-    if(level > loglevel)
+    logbuf_t *lb = malloc(sizeof(logbuf_t));
+    lb->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (lb->fd == -1) {
+        free(lb);
+        return NULL;
+    }
+    pthread_mutex_init(&lb->lock, NULL);
+    lb->used = 0;
+    lb->last_flush = time(NULL);
+    lb->stamp_sec = -1;
+    lb->next = logbufs;
+    logbufs = lb;
+    return lb;
+}
+
+/* Returns this thread's log buffer: its own one if it is dedicated,
+ * otherwise one of the shared ones. Either is created on first use */
+static logbuf_t *get_logbuf()
+{
+    if (thread_logbuf != NULL)
+        return thread_logbuf;
+
+    pthread_mutex_lock(&logbufs_lock);
+    if (thread_dedicated) {
+        thread_logbuf = logbuf_create();
+        if (thread_logbuf != NULL)
+            pthread_setspecific(logbuf_key, thread_logbuf);
+    } else {
+        unsigned int i = atomic_fetch_add(&next_shared_logbuf, 1) % LOGBUF_SHARED_SINKS;
+        if (shared_logbufs[i] == NULL)
+            shared_logbufs[i] = logbuf_create();
+        thread_logbuf = shared_logbufs[i];
+    }
+    pthread_mutex_unlock(&logbufs_lock);
+    return thread_logbuf;
+}
+
+/* Appends a message to this thread's log buffer. Timestamps have
+ * microsecond resolution, so chirc-logmerge can interleave the files.
+ * The clock is read with the buffer locked, so that the lines of a
+ * shared file stay in order. Only the microseconds are formatted on
+ * every line: localtime_r() takes a process-wide lock, so the rest of
+ * the timestamp is only recomputed when the second changes */
+static void __chilog_thread(logsubsys_t subsys, loglevel_t level, const char *levelstr,
+                            char *fmt, va_list argptr)
+{
+    logbuf_t *lb = get_logbuf();
+    struct timespec now;
+    struct tm tm;
+    char msg[LOGLINE_MAX], line[LOGLINE_MAX];
+    int msglen, len;
+
+    if (lb == NULL)
         return;
 
-    t = time(NULL);
-    strftime(buf,80,"%Y-%m-%d %H:%M:%S",localtime(&t));
+    msglen = vsnprintf(msg, sizeof(msg), fmt, argptr);
+    if (msglen >= sizeof(msg))
+        msglen = sizeof(msg) - 1;   /* Truncated */
+
+    pthread_mutex_lock(&lb->lock);
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec != lb->stamp_sec) {
+        localtime_r(&now.tv_sec, &tm);
+        strftime(lb->stamp, sizeof(lb->stamp), "[%Y-%m-%d %H:%M:%S", &tm);
+        lb->stamp_sec = now.tv_sec;
+    }
+    len = snprintf(line, sizeof(line), "%s.%06ld] %6s ", lb->stamp, now.tv_nsec / 1000, levelstr);
+    if (subsys != LOG_GENERAL)
+        len += snprintf(line + len, sizeof(line) - len, "%s: ", subsys_names[subsys]);
+    if (msglen > sizeof(line) - 1 - len)
+        msglen = sizeof(line) - 1 - len;    /* Truncated */
+    memcpy(line + len, msg, msglen);
+    len += msglen;
+    line[len++] = '\n';
+
+    if (lb->used + len > LOGBUF_SIZE)
+        logbuf_flush(lb);
+    memcpy(lb->data + lb->used, line, len);
+    lb->used += len;
+
+    /* Errors usually come right before an exit(), so don't sit on them */
+    if (level <= ERROR || now.tv_sec - lb->last_flush >= LOGBUF_FLUSH_INTERVAL)
+        logbuf_flush(lb);
+    pthread_mutex_unlock(&lb->lock);
+}
+
+/* This function does the actual logging and is called by chilog() and
+ * its variants, once they have decided the message must be printed.
+ * It has a va_list parameter instead of being a variadic function */
+void __chilog(logsubsys_t subsys, loglevel_t level, char *fmt, va_list argptr)
+{
+    time_t t;
+    struct tm tm;
+    char buf[80], *levelstr;
 
     switch(level)
     {
@@ -94,8 +506,18 @@ void __chilog(loglevel_t level, char *fmt, va_list argptr)
         break;
     }
 
+    if (logdir != NULL) {
+        __chilog_thread(subsys, level, levelstr, fmt, argptr);
+        return;
+    }
+
+    t = time(NULL);
+    strftime(buf,80,"%Y-%m-%d %H:%M:%S",localtime_r(&t, &tm));
+
     flockfile(stdout);
     printf("[%s] %6s ", buf, levelstr);
+    if (subsys != LOG_GENERAL)
+        printf("%s: ", subsys_names[subsys]);
 
     vprintf(fmt, argptr);
     printf("\n");
@@ -107,8 +529,120 @@ void chilog(loglevel_t level, char *fmt, ...)
 {
     va_list argptr;
 
+    if (!chilog_enabled(LOG_GENERAL, level))
+        return;
+
+    va_start(argptr, fmt);
+    __chilog(LOG_GENERAL, level, fmt, argptr);
+    va_end(argptr);
+}
+
+void chilog_sub(logsubsys_t subsys, loglevel_t level, char *fmt, ...)
+{
+    va_list argptr;
+
+    if (!chilog_enabled(subsys, level))
+        return;
+
+    va_start(argptr, fmt);
+    __chilog(subsys, level, fmt, argptr);
+    va_end(argptr);
+}
+
+void chilog_conn(bool traced, logsubsys_t subsys, loglevel_t level, char *fmt, ...)
+{
+    va_list argptr;
+
+    if (!traced && !chilog_enabled(subsys, level))
+        return;
+
+    va_start(argptr, fmt);
+    __chilog(subsys, level, fmt, argptr);
+    va_end(argptr);
+}
+
+
+/* Wrapper around __chilog for code that only has a variable argument list */
+static void __chilog_va(logsubsys_t subsys, loglevel_t level, char *fmt, ...)
+{
+    va_list argptr;
+
+    va_start(argptr, fmt);
+    __chilog(subsys, level, fmt, argptr);
+    va_end(argptr);
+}
+
+/* Call sites that have suppressed messages at least once. They are
+ * static, so they are never removed */
+static _Atomic(chilog_ratelimit_t *) ratelimited_sites = NULL;
+
+static void report_suppressed(chilog_ratelimit_t *rl, unsigned int suppressed)
+{
+    const char *file = strrchr(rl->file, '/');
+
+    __chilog_va(rl->subsys, rl->level, "%s:%i: message repeated %u times",
+                file != NULL ? file + 1 : rl->file, rl->line, suppressed);
+}
+
+void chirc_logflush_ratelimited()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    for (chilog_ratelimit_t *rl = atomic_load(&ratelimited_sites); rl != NULL; rl = rl->next) {
+        long long start = atomic_load_explicit(&rl->window_start, memory_order_relaxed);
+        if (now.tv_sec - start < CHILOG_RATELIMIT_INTERVAL)
+            continue;
+        unsigned int suppressed = atomic_exchange(&rl->suppressed, 0);
+        if (suppressed > 0)
+            report_suppressed(rl, suppressed);
+    }
+}
+
+void __chilog_ratelimited(chilog_ratelimit_t *rl, logsubsys_t subsys, loglevel_t level, char *fmt, ...)
+{
+    va_list argptr;
+    struct timespec now;
+    unsigned int suppressed = 0;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    /* Only the thread that wins the exchange starts the new window, and
+     * reports what was suppressed in the previous one */
+    long long start = atomic_load_explicit(&rl->window_start, memory_order_relaxed);
+    if (now.tv_sec - start >= CHILOG_RATELIMIT_INTERVAL &&
+        atomic_compare_exchange_strong(&rl->window_start, &start, now.tv_sec)) {
+        atomic_store_explicit(&rl->count, 1, memory_order_relaxed);
+        suppressed = atomic_exchange(&rl->suppressed, 0);
+    } else if (atomic_fetch_add_explicit(&rl->count, 1, memory_order_relaxed) >= CHILOG_RATELIMIT_BURST) {
+        if (!atomic_load_explicit(&rl->listed, memory_order_relaxed) && !atomic_exchange(&rl->listed, true)) {
+            rl->subsys = subsys;
+            rl->level = level;
+            rl->next = atomic_load(&ratelimited_sites);
+            while (!atomic_compare_exchange_weak(&ratelimited_sites, &rl->next, rl))
+                ;
+        }
+        atomic_fetch_add_explicit(&rl->suppressed, 1, memory_order_relaxed);
+        return;
+    }
+
+    if (suppressed > 0)
+        report_suppressed(rl, suppressed);
+
     va_start(argptr, fmt);
-    __chilog(level, fmt, argptr);
+    __chilog(subsys, level, fmt, argptr);
     va_end(argptr);
 }
 
+void __chilog_sampled(chilog_sample_t *sample, logsubsys_t subsys, loglevel_t level, char *fmt, ...)
+{
+    va_list argptr;
+    unsigned int rate = atomic_load_explicit(&sample_rate, memory_order_relaxed);
+
+    if (atomic_fetch_add_explicit(&sample->count, 1, memory_order_relaxed) % rate != 0)
+        return;
+
+    va_start(argptr, fmt);
+    __chilog(subsys, level, fmt, argptr);
+    va_end(argptr);
+}
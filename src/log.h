@@ -14,6 +14,17 @@
  *  DEBUG: Lower-level information
  *  TRACE: Very low-level information.
  *
+ *  Messages can also be tagged with a subsystem (net, parse, channel,
+ *  link), each of which has its own log level. Individual connections
+ *  can additionally be marked as traced, in which case all of their
+ *  messages are printed regardless of the subsystem's level.
+ *
+ *  Levels can be changed at runtime with chirc_loadlogconf().
+ *
+ *  Messages that can be triggered by remote peers at a high rate should
+ *  use chilog_ratelimited(), and high-volume DEBUG/TRACE messages can
+ *  use chilog_sampled(), so that logging never becomes the bottleneck.
+ *
  */
 
 /*
@@ -51,6 +62,24 @@
 #ifndef CHIRC_LOG_H_
 #define CHIRC_LOG_H_
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+
+/* Each rate-limited call site prints at most CHILOG_RATELIMIT_BURST
+ * messages every CHILOG_RATELIMIT_INTERVAL seconds */
+#define CHILOG_RATELIMIT_INTERVAL   (1)
+#define CHILOG_RATELIMIT_BURST      (10)
+
+/* Log files (see chirc_setlogdir) are written through a buffer of
+ * LOGBUF_SIZE bytes, flushed when full or at most LOGBUF_FLUSH_INTERVAL
+ * seconds after the last flush. Threads that are not dedicated share
+ * LOGBUF_SHARED_SINKS files */
+#define LOGBUF_SIZE                 (64 * 1024)
+#define LOGBUF_SHARED_SINKS         (8)
+#define LOGBUF_FLUSH_INTERVAL       (1)
+#define LOGLINE_MAX                 (1024)
+
 /* Log levels */
 typedef enum {
     QUIET    = 00,
@@ -62,6 +91,35 @@ typedef enum {
     TRACE    = 60
 } loglevel_t;
 
+/* Log subsystems */
+typedef enum {
+    LOG_GENERAL = 0,
+    LOG_NET     = 1,
+    LOG_PARSE   = 2,
+    LOG_CHANNEL = 3,
+    LOG_LINK    = 4,
+    LOG_NUM_SUBSYS
+} logsubsys_t;
+
+/* One bitmask per log level (indexed by level / 10). Bit N is set if
+ * subsystem N prints messages at that level. Only meant to be accessed
+ * through chilog_enabled() */
+extern atomic_uint __chirc_logmask[TRACE / 10 + 1];
+
+/*
+ * chilog_enabled - Checks whether a message would be printed
+ *
+ * Cheap enough to use as a guard around expensive log arguments.
+ *
+ * subsys: Subsystem of the message
+ *
+ * level: Logging level of the message
+ *
+ * Returns: non-zero if the message would be printed.
+ */
+#define chilog_enabled(subsys, level) \
+    (atomic_load_explicit(&__chirc_logmask[(level) / 10], memory_order_relaxed) & (1u << (subsys)))
+
 /*
  * chitcp_setloglevel - Sets the logging level
  *
@@ -76,6 +134,149 @@ typedef enum {
 void chirc_setloglevel(loglevel_t level);
 
 
+/*
+ * chirc_setsubsysloglevel - Sets the logging level of a single subsystem
+ *
+ * subsys: Subsystem
+ *
+ * level: Logging level
+ *
+ * Returns: Nothing.
+ */
+void chirc_setsubsysloglevel(logsubsys_t subsys, loglevel_t level);
+
+
+/*
+ * chirc_adjustloglevel - Raises or lowers the level of every subsystem
+ *
+ * steps: Number of levels to move by (positive is more verbose). Levels
+ *        are clamped to QUIET and TRACE.
+ *
+ * Returns: Nothing.
+ */
+void chirc_adjustloglevel(int steps);
+
+
+/*
+ * chirc_setlogdir - Sends log messages to buffered files
+ *
+ * Instead of sharing stdout, threads append to files (DIR/chirc-PID-N.log)
+ * through a buffer. Threads marked with chirc_logthread_dedicated() get
+ * their own file and never contend on a lock. All other threads (e.g.
+ * one per client) are spread over LOGBUF_SHARED_SINKS shared files, so
+ * their number does not bound the number of files. A buffer is flushed
+ * when it is full, when an ERROR or CRITICAL message is logged, when a
+ * message is logged at least LOGBUF_FLUSH_INTERVAL seconds after the
+ * previous flush, by chirc_logflush_idle(), and when a dedicated thread
+ * exits. Use chirc-logmerge to interleave the files.
+ *
+ * Must be called before any other thread is created.
+ *
+ * dir: Existing directory to write the files to
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int chirc_setlogdir(const char *dir);
+
+
+/*
+ * chirc_logthread_dedicated - Gives the calling thread its own log file
+ *
+ * Meant for the few long-lived threads that log often (the main thread,
+ * the signal thread, worker pools). Should be called before the thread
+ * logs anything. Has no effect unless chirc_setlogdir() is called too.
+ *
+ * Returns: Nothing.
+ */
+void chirc_logthread_dedicated();
+
+
+/*
+ * chirc_logflush - Flushes the calling thread's log file buffer
+ *
+ * Does nothing unless chirc_setlogdir() has been called.
+ *
+ * Returns: Nothing.
+ */
+void chirc_logflush();
+
+
+/*
+ * chirc_logflush_idle - Flushes the log file buffers of all threads
+ *
+ * Flushes every buffer that holds messages and has not been flushed for
+ * LOGBUF_FLUSH_INTERVAL seconds, so the messages of a thread that has
+ * stopped logging (e.g. one blocked on an idle client) still reach its
+ * file. Must be called every LOGBUF_FLUSH_INTERVAL seconds by one
+ * thread. Does nothing unless chirc_setlogdir() has been called.
+ *
+ * Returns: Nothing.
+ */
+void chirc_logflush_idle();
+
+
+/*
+ * chirc_logreset - Forgets the log file buffers inherited over fork()
+ *
+ * Must be called in a child process right after fork(), before it logs
+ * anything. The child then writes to its own files (named after its
+ * pid) instead of appending to the parent's, which would break the
+ * single ordered stream per file that chirc-logmerge relies on. Whatever
+ * the parent had buffered is discarded in the child; the parent still
+ * writes it out. Does nothing unless chirc_setlogdir() has been called.
+ *
+ * Returns: Nothing.
+ */
+void chirc_logreset();
+
+
+/*
+ * chirc_loadlogconf - Loads log levels and traced nicks from a file
+ *
+ * The file contains one directive per line. Blank lines and lines
+ * starting with # are ignored:
+ *
+ *   level=DEBUG        Sets the level of every subsystem
+ *   net=TRACE          Sets the level of one subsystem (general, net,
+ *                      parse, channel, link)
+ *   trace=nick         Traces all messages of the connection using
+ *                      this nick (may be repeated)
+ *   sample=N           Sets the sampling rate of chilog_sampled()
+ *
+ * The traced nicks are replaced by the ones in the file, so a file
+ * without trace= lines turns off per-connection tracing.
+ *
+ * path: Path of the file
+ *
+ * Returns: 0 on success, -1 if the file could not be read.
+ */
+int chirc_loadlogconf(const char *path);
+
+
+/*
+ * chirc_logtrace_generation - Returns the current trace generation
+ *
+ * The generation changes every time the set of traced nicks changes,
+ * so connections only need to call chirc_logtrace_nick() again when
+ * it differs from the one they last saw.
+ *
+ * Returns: the generation number.
+ */
+unsigned int chirc_logtrace_generation();
+
+
+/*
+ * chirc_logtrace_nick - Checks whether a nick is traced
+ *
+ * nick: Nick of the connection (need not be NUL-terminated; may be NULL)
+ *
+ * len: Length of the nick
+ *
+ * Returns: true if all messages of this connection should be printed.
+ */
+bool chirc_logtrace_nick(const char *nick, size_t len);
+
+
 /*
  * chilog - Print a log message
  *
@@ -90,4 +291,133 @@ void chirc_setloglevel(loglevel_t level);
 void chilog(loglevel_t level, char *fmt, ...);
 
 
+/*
+ * chilog_sub - Print a log message belonging to a subsystem
+ *
+ * subsys: Subsystem of the message
+ *
+ * level: Logging level of the message
+ *
+ * fmt: printf-style formatting string
+ *
+ * ...: Extra parameters if needed by fmt
+ *
+ * Returns: nothing.
+ */
+void chilog_sub(logsubsys_t subsys, loglevel_t level, char *fmt, ...);
+
+
+/*
+ * chilog_conn - Print a log message about a connection
+ *
+ * Same as chilog_sub, but the message is always printed if the
+ * connection is traced.
+ *
+ * traced: Whether the connection is traced
+ *
+ * subsys: Subsystem of the message
+ *
+ * level: Logging level of the message
+ *
+ * fmt: printf-style formatting string
+ *
+ * ...: Extra parameters if needed by fmt
+ *
+ * Returns: nothing.
+ */
+void chilog_conn(bool traced, logsubsys_t subsys, loglevel_t level, char *fmt, ...);
+
+
+/* Per-call-site state of chilog_ratelimited(). */
+typedef struct chilog_ratelimit {
+    const char *file;               // Call site, used to label summaries
+    int line;
+    atomic_llong window_start;      // Start of the current window (seconds)
+    atomic_uint count;              // Messages seen in the current window
+    atomic_uint suppressed;         // Messages suppressed since the last summary
+    atomic_bool listed;             // Whether it is in the list chirc_logflush_ratelimited() checks
+    logsubsys_t subsys;             // Of the summary, set before it is listed
+    loglevel_t level;
+    struct chilog_ratelimit *next;
+} chilog_ratelimit_t;
+
+/* Per-call-site state of chilog_sampled(). */
+typedef struct {
+    atomic_uint count;
+} chilog_sample_t;
+
+void __chilog_ratelimited(chilog_ratelimit_t *rl, logsubsys_t subsys, loglevel_t level, char *fmt, ...);
+
+
+/*
+ * chirc_logflush_ratelimited - Reports suppressed rate-limited messages
+ *
+ * Prints the "repeated N times" summary of every chilog_ratelimited()
+ * call site whose window is over, so the last burst of a flood is
+ * reported even if the call site never logs again. Must be called
+ * every CHILOG_RATELIMIT_INTERVAL seconds by one thread.
+ *
+ * Returns: Nothing.
+ */
+void chirc_logflush_ratelimited();
+void __chilog_sampled(chilog_sample_t *sample, logsubsys_t subsys, loglevel_t level, char *fmt, ...);
+
+
+/*
+ * chilog_ratelimited - Print a log message, rate-limited per call site
+ *
+ * Takes the same parameters as chilog_sub. Messages beyond the burst
+ * allowed by CHILOG_RATELIMIT_BURST / CHILOG_RATELIMIT_INTERVAL are
+ * counted but not printed, and the count is reported ("file.c:123:
+ * message repeated N times") the next time this call site prints a
+ * message, or by chirc_logflush_ratelimited() once the window is over.
+ */
+#define chilog_ratelimited(subsys, level, ...)                                  \
+    do {                                                                        \
+        static chilog_ratelimit_t __chilog_rl = {.file = __FILE__, .line = __LINE__}; \
+        if (chilog_enabled(subsys, level))                                      \
+            __chilog_ratelimited(&__chilog_rl, subsys, level, __VA_ARGS__);     \
+    } while (0)
+
+
+/*
+ * chilog_conn_ratelimited - Rate-limited version of chilog_conn
+ *
+ * Messages about traced connections are never suppressed.
+ */
+#define chilog_conn_ratelimited(traced, subsys, level, ...)                     \
+    do {                                                                        \
+        if (traced)                                                             \
+            chilog_conn(true, subsys, level, __VA_ARGS__);                      \
+        else                                                                    \
+            chilog_ratelimited(subsys, level, __VA_ARGS__);                     \
+    } while (0)
+
+
+/*
+ * chilog_sampled - Print one in every N log messages of a call site
+ *
+ * Takes the same parameters as chilog_sub. N is set with
+ * chirc_setlogsampling() (or sample= in the log configuration file),
+ * and defaults to 1 (print every message).
+ */
+#define chilog_sampled(subsys, level, ...)                                      \
+    do {                                                                        \
+        static chilog_sample_t __chilog_sample;                                 \
+        if (chilog_enabled(subsys, level))                                      \
+            __chilog_sampled(&__chilog_sample, subsys, level, __VA_ARGS__);     \
+    } while (0)
+
+
+/*
+ * chirc_setlogsampling - Sets the sampling rate of chilog_sampled()
+ *
+ * rate: Only one in every rate messages of each call site is printed.
+ *       Values below 1 are treated as 1.
+ *
+ * Returns: Nothing.
+ */
+void chirc_setlogsampling(unsigned int rate);
+
+
 #endif /* CHIRC_LOG_H_ */
@@ -0,0 +1,74 @@
+/*
+ *
+ *  chirc: a simple multi-threaded IRC server
+ *
+ *  chirc-logmerge: merges the per-thread log files written when chirc
+ *  is run with -D LOG_DIR into a single stream, ordered by timestamp.
+ *
+ *  Usage: chirc-logmerge FILE...
+ *
+ *  Every file is already in timestamp order, so this is a plain k-way
+ *  merge. Timestamps are fixed-width, so comparing the start of each
+ *  line as a string is enough.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+// Length of "[YYYY-MM-DD HH:MM:SS.uuuuuu]"
+#define TIMESTAMP_LEN 28
+
+typedef struct log_file {
+    FILE *f;
+    char *line;
+    size_t line_size;
+    bool eof;
+} log_file;
+
+void advance(log_file *lf) {
+    if (getline(&lf->line, &lf->line_size, lf->f) == -1) {
+        lf->eof = true;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: chirc-logmerge FILE...\n");
+        exit(-1);
+    }
+
+    int num_files = argc - 1;
+    log_file *files = calloc(num_files, sizeof(log_file));
+    for (int i = 0; i < num_files; i++) {
+        files[i].f = fopen(argv[i + 1], "r");
+        if (files[i].f == NULL) {
+            fprintf(stderr, "ERROR: Could not open %s\n", argv[i + 1]);
+            exit(-1);
+        }
+        advance(&files[i]);
+    }
+
+    while (true) {
+        log_file *next = NULL;
+        for (int i = 0; i < num_files; i++) {
+            if (!files[i].eof && (next == NULL || strncmp(files[i].line, next->line, TIMESTAMP_LEN) < 0)) {
+                next = &files[i];
+            }
+        }
+        if (next == NULL) {
+            break;
+        }
+        fputs(next->line, stdout);
+        advance(next);
+    }
+
+    for (int i = 0; i < num_files; i++) {
+        fclose(files[i].f);
+        free(files[i].line);
+    }
+    free(files);
+    return 0;
+}
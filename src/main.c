@@ -39,6 +39,8 @@
  *
  */
 
+#define _GNU_SOURCE     // ppoll, asprintf
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -46,89 +48,1012 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <signal.h>
+#include <poll.h>
 
 #include <pthread.h>
 
 #include "log.h"
 #include "client.h"
 #include "reply.h"
+#include "stats.h"
+#include "accounts.h"
+#include "workpool.h"
+#include "ident.h"
+#include "motd.h"
 #include "message.c"
 
-void send_data(client *c, char *data) {
-    write(c->sockfd, data, strlen(data));
+static char *logconf_file = NULL;
+static char *log_dir = NULL;
+static char *metrics_file = NULL;
+static bool measure_latency = false;
+static long coalesce_max_us = 0;
+static int num_workers = 0;
+static char *accounts_file = NULL;
+static long ident_timeout_ms = 0;     // 0: no ident queries
+
+// Recomputes whether this connection is traced, if the set of traced nicks has changed
+void update_log_trace(client *c) {
+    unsigned int generation = chirc_logtrace_generation();
+    if (c->logTraceGeneration != generation) {
+        c->logTraceGeneration = generation;
+        c->logTrace = chirc_logtrace_nick(c->nick.s, c->nick.len);
+    }
+}
+
+// SIGHUP reloads the log configuration file and the account store, SIGUSR1 / SIGUSR2 raise / lower all log levels.
+// This thread also reports suppressed rate-limited log messages and flushes idle log file buffers every
+// second, and writes the metrics file, if any, every METRICS_INTERVAL seconds.
+void *handle_signals(void *ptr) {
+    sigset_t *signals = (sigset_t *) ptr;
+    struct timespec tick = {1, 0};
+    chirc_logthread_dedicated();
+    time_t next_metrics = time(NULL) + METRICS_INTERVAL;
+    while (true) {
+        int sig = sigtimedwait(signals, NULL, &tick);
+        chirc_logflush_ratelimited();
+        if (log_dir != NULL) {
+            chirc_logflush_idle();
+        }
+        if (metrics_file != NULL && time(NULL) >= next_metrics) {
+            stats_write_metrics(metrics_file);
+            next_metrics = time(NULL) + METRICS_INTERVAL;
+        }
+        if (sig == -1) {
+            continue;
+        }
+        switch (sig) {
+        case SIGHUP:
+            if (logconf_file != NULL) {
+                chirc_loadlogconf(logconf_file);
+            }
+            if (accounts_file != NULL) {
+                account_store_load(accounts_file);
+            }
+            if (logconf_file == NULL && accounts_file == NULL) {
+                chilog(WARNING, "Received SIGHUP, but there is nothing to reload (-L / -a)");
+            }
+            break;
+        case SIGUSR1:
+            chirc_adjustloglevel(1);
+            break;
+        case SIGUSR2:
+            chirc_adjustloglevel(-1);
+            break;
+        }
+    }
+}
+
+// A reply is built by appending fragments, then sent with a single write
+typedef struct reply {
+    char data[MAX_MESSAGE_LENGTH];
+    size_t len;
+} reply;
+
+// Appends to a reply, truncating it if it would not fit (leaving space for the CRLF)
+void reply_append(reply *r, chistr str) {
+    size_t space = MAX_MESSAGE_LENGTH - 2 - r->len;
+    size_t len = str.len < space ? str.len : space;
+    memcpy(r->data + r->len, str.s, len);
+    r->len += len;
+}
+
+// Writes out everything queued for the client, then records the latency of the deliveries
+void flush_client(client *c) {
+    if (c->out.queued > 0) {
+        stats_record_flush(c->out.queued, c->coalesceWindowUs);
+    }
+    c->coalescedReads = 0;
+    if (outbuf_flush(&c->out, c->sockfd) == -1) {
+        chilog_conn_ratelimited(c->logTrace, LOG_NET, DEBUG, "Failed to write to client connection");
+        c->numPendingDeliveries = 0;
+        c->coalesceWindowUs = 0;
+        c->coalescedReads = 0;
+        return;
+    }
+    for (int i = 0; i < c->numPendingDeliveries; i++) {
+        stats_record_delivery(DELIVERY_LOCAL, &c->pendingRxTimes[i]);
+    }
+    c->numPendingDeliveries = 0;
+}
+
+// Data is queued, and written out by flush_client once the lines of the current read are processed
+void send_data(client *c, chistr data) {
+    outbuf_append(&c->out, data);
+}
+
+// Marks the end of a reply to the line being processed, so its latency is recorded when flushed
+void queue_delivery(client *c) {
+    if (!measure_latency) {
+        return;
+    }
+    if (c->numPendingDeliveries == MAX_PENDING_DELIVERIES) {
+        flush_client(c);
+    }
+    c->pendingRxTimes[c->numPendingDeliveries++] = c->lineRxTime;
+}
+
+// Terminates the reply with CRLF and sends it
+void send_reply(client *c, reply *r) {
+    r->data[r->len++] = '\r';
+    r->data[r->len++] = '\n';
+    send_data(c, chistr_make(r->data, r->len));
 }
 
 void send_welcome_message(client *c) {
     // <s_host> <RPL_WELCOME> <nick> :Welcome to the Internet Relay Network <username>!<fullName>@<c_host>
-    send_data(c, ":irc.alexbostock.co.uk ");
-    send_data(c, RPL_WELCOME);
-    send_data(c, " ");
-    send_data(c, c->nick);
-    send_data(c, " :Welcome to the Internet Relay Network ");
-    send_data(c, c->nick);
-    send_data(c, "!");
-    send_data(c, c->username);
-    send_data(c, "@");
-    send_data(c, "foo.example.com\r\n"); // TODO: get client's hostname
+    reply r = {.len = 0};
+    reply_append(&r, CHISTR_LIT(":irc.alexbostock.co.uk "));
+    reply_append(&r, CHISTR_LIT(RPL_WELCOME));
+    reply_append(&r, CHISTR_LIT(" "));
+    reply_append(&r, c->nick);
+    reply_append(&r, CHISTR_LIT(" :Welcome to the Internet Relay Network "));
+    reply_append(&r, c->nick);
+    reply_append(&r, CHISTR_LIT("!"));
+    reply_append(&r, c->username);
+    reply_append(&r, CHISTR_LIT("@"));
+    reply_append(&r, CHISTR_LIT("foo.example.com")); // TODO: get client's hostname
+    send_reply(c, &r);
     c->welcomeMessageSent = true;
+    queue_delivery(c);
+}
+
+// Read from the directory the server is started in
+#define MOTD_FILE "motd.txt"
+
+void send_motd(client *c) {
+    const motd *m = motd_acquire();
+    for (int i = 0; i < m->num_nicks; i++) {
+        send_data(c, m->segments[i]);
+        send_data(c, c->nick);
+    }
+    send_data(c, m->segments[m->num_nicks]);
+    motd_release(m);
+    queue_delivery(c);
 }
 
-void process_message(char *message, int message_length, client *c) {
-    msg *m = parse_message(message, message_length);
-    if (strcmp(m->command, "NICK") == 0) {
-        chilog(INFO, "Processing NICK");
-        c->nick = get_arg(m, 0);
-        chilog(INFO, "Parsed nick: %s", c->nick);
-    } else if (strcmp(m->command, "USER") == 0) {
-        chilog(INFO, "Processing USER");
-        c->username = get_arg(m, 0);
-        c->fullName = get_arg(m, 3);
-        chilog(INFO, "Parsed username: %s", c->username);
-        chilog(INFO, "Parsed fullName: %s", c->fullName);
+// A registered account's nick can only be taken by logging in to it with PASS at registration,
+// so a registered client may only change to it if that is the account it logged in to
+bool may_use_nick(client *c, chistr nick) {
+    const account *a = account_lookup(nick);
+    return a == NULL || strcmp(a->name, c->account) == 0;
+}
+
+void process_message(chistr line, client *c) {
+    update_log_trace(c);
+    chilog_conn(c->logTrace, LOG_NET, TRACE, "Received: %.*s", CHISTR_FMT(line));
+    msg m;
+    parse_message(line, &m);
+    if (chistr_eq(m.command, CHISTR_LIT("NICK")) && m.numArgs < 1) {
+        // Keep the current nick, replies still need it
+        reply r = {.len = 0};
+        reply_append(&r, CHISTR_LIT(":irc.alexbostock.co.uk " ERR_NONICKNAMEGIVEN " "));
+        reply_append(&r, c->nick.len > 0 ? c->nick : CHISTR_LIT("*"));
+        reply_append(&r, CHISTR_LIT(" :No nickname given"));
+        send_reply(c, &r);
+        queue_delivery(c);
+    } else if (chistr_eq(m.command, CHISTR_LIT("NICK")) && !may_use_nick(c, get_arg(&m, 0))) {
+        chilog_conn_ratelimited(c->logTrace, LOG_NET, INFO, "Refused NICK to registered account %.*s", CHISTR_FMT(get_arg(&m, 0)));
+        reply r = {.len = 0};
+        reply_append(&r, CHISTR_LIT(":irc.alexbostock.co.uk " ERR_NICKNAMEINUSE " "));
+        reply_append(&r, c->nick);
+        reply_append(&r, CHISTR_LIT(" "));
+        reply_append(&r, get_arg(&m, 0));
+        reply_append(&r, CHISTR_LIT(" :Nickname is already in use"));
+        send_reply(c, &r);
+        queue_delivery(c);
+    } else if (chistr_eq(m.command, CHISTR_LIT("NICK"))) {
+        chilog_conn(c->logTrace, LOG_PARSE, INFO, "Processing NICK");
+        chistr_free(&c->nick);
+        c->nick = chistr_dup(get_arg(&m, 0));
+        c->logTrace = chirc_logtrace_nick(c->nick.s, c->nick.len);
+        chilog_conn(c->logTrace, LOG_PARSE, INFO, "Parsed nick: %.*s", CHISTR_FMT(c->nick));
+    } else if (chistr_eq(m.command, CHISTR_LIT("USER"))) {
+        chilog_conn(c->logTrace, LOG_PARSE, INFO, "Processing USER");
+        chistr_free(&c->username);
+        chistr_free(&c->fullName);
+        c->username = chistr_dup(get_arg(&m, 0));
+        c->fullName = chistr_dup(get_arg(&m, 3));
+        chilog_conn(c->logTrace, LOG_PARSE, INFO, "Parsed username: %.*s", CHISTR_FMT(c->username));
+        chilog_conn(c->logTrace, LOG_PARSE, INFO, "Parsed fullName: %.*s", CHISTR_FMT(c->fullName));
+    } else if (chistr_eq(m.command, CHISTR_LIT("MOTD")) && c->welcomeMessageSent) {
+        send_motd(c);
     } else {
-        chilog(ERROR, "Unexpected command %s", m->command);
+        chilog_conn_ratelimited(c->logTrace, LOG_PARSE, ERROR, "Unexpected command %.*s", CHISTR_FMT(m.command));
     }
-    free_message(m);
 
-    if (c->nick != NULL && c->username != NULL && !c->welcomeMessageSent) {
+    if (!chistr_isnull(c->nick) && !chistr_isnull(c->username) && !c->welcomeMessageSent) {
         send_welcome_message(c);
+        send_motd(c);
     }
 }
 
+// Keepalives make up most of the traffic of idle clients, so they are recognised by
+// prefix and answered here, without parsing, dispatching or allocating anything
+static const chistr pong_reply = CHISTR_LIT(":irc.alexbostock.co.uk PONG irc.alexbostock.co.uk\r\n");
+
+// Checks whether a line starts with a 4-letter keepalive command (PING or PONG)
+bool is_keepalive(chistr line, const char *command) {
+    return line.len >= 4 && (line.len == 4 || line.s[4] == ' ') && memcmp(line.s, command, 4) == 0;
+}
+
+bool process_keepalive(chistr line, client *c) {
+    if (is_keepalive(line, "PING")) {
+        chilog_conn(c->logTrace, LOG_NET, TRACE, "Received: %.*s", CHISTR_FMT(line));
+        send_data(c, pong_reply);
+        queue_delivery(c);
+        return true;
+    }
+    if (is_keepalive(line, "PONG")) {
+        // Nothing checks client liveness yet, so a PONG is only consumed
+        chilog_conn(c->logTrace, LOG_NET, TRACE, "Received: %.*s", CHISTR_FMT(line));
+        return true;
+    }
+    return false;
+}
+
 int process_buffered_messages(char *buffer, int buffer_size, int buffer_offset, client *c) {
     int message_start_offset = 0;
     for (int i = 1; i < buffer_offset - 1; i++) {
         if (buffer[i] == '\r' && buffer[i+1] == '\n') {
             int message_length = i - message_start_offset;
-            process_message(buffer+message_start_offset, message_length, c);
+            // Only the first line can have started in an earlier read
+            c->lineRxTime = message_start_offset == 0 ? c->partialRxTime : c->readRxTime;
+            chistr line = chistr_make(buffer + message_start_offset, message_length);
+            if (!process_keepalive(line, c)) {
+                process_message(line, c);
+            }
             message_start_offset = i+2;
         }
     }
+    if (message_start_offset > 0) {
+        c->partialRxTime = c->readRxTime;
+    }
     if (message_start_offset == 0 && buffer_offset == buffer_size) {
-        chilog(WARNING, "Buffer full of an oversized / invalid message. Dropping buffered data");
+        chilog_conn_ratelimited(c->logTrace, LOG_NET, WARNING, "Buffer full of an oversized / invalid message. Dropping buffered data");
         return buffer_size;
     }
     return message_start_offset;
 }
 
+// Enables kernel software receive timestamps on a client socket
+void enable_rx_timestamps(client *c) {
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (setsockopt(c->sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == -1) {
+        chilog_ratelimited(LOG_NET, WARNING, "Could not enable receive timestamps, using read times instead");
+    }
+}
+
+// Same as read(), but also stores in c->readRxTime when the kernel received the data
+// (or when the read returned, if the kernel did not provide a timestamp)
+int read_timestamped(client *c, char *buf, int len) {
+    char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control)
+    };
+    int bytes_read = recvmsg(c->sockfd, &mh, 0);
+    clock_gettime(CLOCK_REALTIME, &c->readRxTime);
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping *ts = (struct scm_timestamping *) CMSG_DATA(cmsg);
+            if (ts->ts[0].tv_sec != 0) {
+                c->readRxTime = ts->ts[0];
+            }
+        }
+    }
+    return bytes_read;
+}
+
+// Output coalescing (-c MAX_US). Under load, output may wait for the replies to the next reads
+// so that more of them go out per syscall, for at most the connection's coalescing window or
+// until COALESCE_MAX_BYTES are queued. The window starts at 0 (flush immediately), and adapts:
+// it doubles (up to MAX_US) while more input keeps arriving before it expires, and halves
+// (down to 0) when it expires without more input.
+#define COALESCE_MIN_US 50
+#define COALESCE_MAX_BYTES (16 * 1024)
+#define COALESCE_BUSY_BYTES (2 * 1024)      // A single read producing this much output means a burst
+
+long timespec_until_us(const struct timespec *deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (deadline->tv_sec - now.tv_sec) * 1000000L + (deadline->tv_nsec - now.tv_nsec) / 1000;
+}
+
+void grow_coalesce_window(client *c) {
+    long window = c->coalesceWindowUs == 0 ? COALESCE_MIN_US : c->coalesceWindowUs * 2;
+    c->coalesceWindowUs = window < coalesce_max_us ? window : coalesce_max_us;
+}
+
+void shrink_coalesce_window(client *c) {
+    c->coalesceWindowUs /= 2;
+    if (c->coalesceWindowUs < COALESCE_MIN_US) {
+        c->coalesceWindowUs = 0;
+    }
+}
+
+// Called once the lines of a read are processed: flushes now, or sets a deadline to flush by
+void flush_or_coalesce(client *c) {
+    if (c->out.queued == 0) {
+        return;
+    }
+    c->coalescedReads++;
+    if (c->coalesceWindowUs == 0) {
+        if (coalesce_max_us > 0 && c->out.queued >= COALESCE_BUSY_BYTES) {
+            grow_coalesce_window(c);
+        }
+        flush_client(c);
+        return;
+    }
+    if (c->coalescedReads == 1) {
+        clock_gettime(CLOCK_MONOTONIC, &c->flushDeadline);
+        c->flushDeadline.tv_nsec += c->coalesceWindowUs * 1000;
+        c->flushDeadline.tv_sec += c->flushDeadline.tv_nsec / 1000000000;
+        c->flushDeadline.tv_nsec %= 1000000000;
+    }
+    if (c->out.queued >= COALESCE_MAX_BYTES || timespec_until_us(&c->flushDeadline) <= 0) {
+        if (c->coalescedReads > 1) {
+            grow_coalesce_window(c);
+        }
+        flush_client(c);
+    }
+}
+
+// Waits for input while output is being coalesced. Returns false (after flushing) if the
+// coalescing window expired first
+bool wait_for_input(client *c) {
+    if (c->out.queued == 0) {
+        return true;
+    }
+    long remaining_us = timespec_until_us(&c->flushDeadline);
+    struct pollfd pfd = {.fd = c->sockfd, .events = POLLIN};
+    struct timespec timeout = {remaining_us / 1000000, (remaining_us % 1000000) * 1000};
+    if (remaining_us > 0 && ppoll(&pfd, 1, &timeout, NULL) != 0) {
+        return true;
+    }
+    if (c->coalescedReads == 1) {
+        shrink_coalesce_window(c);
+    }
+    flush_client(c);
+    return false;
+}
+
+void free_client(client *c) {
+    outbuf_clear(&c->out);
+    close(c->sockfd);
+    chistr_free(&c->nick);
+    chistr_free(&c->username);
+    chistr_free(&c->fullName);
+    free(c);
+}
+
+// Receive buffers start small and grow geometrically while reads keep filling them. Once a read
+// drains the socket, the buffer goes back to its initial size before the thread blocks again,
+// so idle clients never hold a large one. The initial size fits one full IRC line
+#define RECV_BUFFER_INITIAL_SIZE MAX_MESSAGE_LENGTH
+#define RECV_BUFFER_MAX_SIZE (16 * 1024)
+
 void *process_client_messages(void *ptr) {
     client *c = (client *) ptr;
-    const int buffer_size = 1024;
+    int buffer_size = RECV_BUFFER_INITIAL_SIZE;
     char *buffer = malloc(buffer_size * sizeof(char));
     int buffer_offset = 0;
+    if (measure_latency) {
+        enable_rx_timestamps(c);
+    }
+    // Registration was completed by the main thread, which may also have read some more lines
+    send_welcome_message(c);
+    send_motd(c);
+    memcpy(buffer, c->initialData.s, c->initialData.len);
+    buffer_offset = c->initialData.len;
+    chistr_free(&c->initialData);
+    c->partialRxTime = c->readRxTime = c->lineRxTime;
+    int consumed_offset = process_buffered_messages(buffer, buffer_size, buffer_offset, c);
+    memmove(buffer, buffer + consumed_offset, buffer_offset - consumed_offset);
+    buffer_offset -= consumed_offset;
+    flush_client(c);
     while (true) {
-        int bytes_read = read(c->sockfd, buffer + buffer_offset, buffer_size - buffer_offset);
+        if (!wait_for_input(c)) {
+            continue;
+        }
+        int bytes_read;
+        if (measure_latency) {
+            bytes_read = read_timestamped(c, buffer + buffer_offset, buffer_size - buffer_offset);
+            if (buffer_offset == 0) {
+                c->partialRxTime = c->readRxTime;
+            }
+        } else {
+            bytes_read = read(c->sockfd, buffer + buffer_offset, buffer_size - buffer_offset);
+        }
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
         if (bytes_read == -1) {
-            chilog(ERROR, "Failed to read from client connection");
-            exit(1);
+            chilog_conn_ratelimited(c->logTrace, LOG_NET, ERROR, "Failed to read from client connection");
+            break;
+        }
+        if (bytes_read == 0) {
+            chilog_conn(c->logTrace, LOG_NET, DEBUG, "Client closed the connection");
+            break;
         }
         buffer_offset += bytes_read;
+
+        // A read that filled the buffer probably left more data in the socket
+        bool drained = buffer_offset < buffer_size;
+        if (!drained && buffer_size < RECV_BUFFER_MAX_SIZE) {
+            buffer_size *= 2;
+            buffer = realloc(buffer, buffer_size * sizeof(char));
+            chilog_conn(c->logTrace, LOG_NET, TRACE, "Receive buffer grown to %i bytes", buffer_size);
+        }
+
         int consumed_offset = process_buffered_messages(buffer, buffer_size, buffer_offset, c);
-        // Assuming that memcpy copies bytes sequential in order (otherwise this might not work)
-        memcpy(buffer, buffer + consumed_offset, consumed_offset);
+        memmove(buffer, buffer + consumed_offset, buffer_offset - consumed_offset);
         buffer_offset -= consumed_offset;
+        flush_or_coalesce(c);
+
+        // Whatever is left is a partial line, which normally fits in the initial size
+        if (drained && buffer_size > RECV_BUFFER_INITIAL_SIZE && buffer_offset < RECV_BUFFER_INITIAL_SIZE) {
+            buffer_size = RECV_BUFFER_INITIAL_SIZE;
+            buffer = realloc(buffer, buffer_size * sizeof(char));
+            chilog_conn(c->logTrace, LOG_NET, TRACE, "Receive buffer shrunk to %i bytes", buffer_size);
+        }
+    }
+    flush_client(c);
+    free(buffer);
+    free_client(c);
+    outbuf_pool_release();
+    return NULL;
+}
+
+// Seconds the kernel waits for data on a new connection before handing it to accept() anyway
+#define DEFER_ACCEPT_TIMEOUT 30
+
+// Seconds a connection may take to register, after which it is dropped
+#define REGISTRATION_TIMEOUT 30
+
+// Sets a CLOCK_MONOTONIC deadline the given number of milliseconds from now
+void set_deadline_ms(struct timespec *deadline, long ms) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000;
+    deadline->tv_sec += deadline->tv_nsec / 1000000000;
+    deadline->tv_nsec %= 1000000000;
+}
+
+// Lowers a poll() timeout (-1: none) so that poll() returns by the deadline
+void poll_until(int *timeout_ms, const struct timespec *deadline) {
+    long remaining_ms = timespec_until_us(deadline) / 1000 + 1;
+    if (remaining_ms < 0) {
+        remaining_ms = 0;
+    }
+    if (*timeout_ms == -1 || remaining_ms < *timeout_ms) {
+        *timeout_ms = remaining_ms;
+    }
+}
+
+// Copies an argument into a fixed-size field of a pending client, truncating it if needed
+void copy_arg(char *dst, size_t size, chistr arg) {
+    size_t len = arg.len < size - 1 ? arg.len : size - 1;
+    memcpy(dst, arg.s, len);
+    dst[len] = '\0';
+}
+
+// Creates the full client record of a connection that has just registered, and its thread.
+// leftover is whatever was received after the line that completed the registration
+void register_client(pending_client *p, chistr leftover) {
+    client *c = malloc(sizeof(client));
+    c->sockfd = p->sockfd;
+    c->nick = chistr_dup(chistr_make(p->nick, strlen(p->nick)));
+    snprintf(c->account, sizeof(c->account), "%s", p->account);
+    if (p->ident[0] != '\0') {
+        c->username = chistr_dup(chistr_make(p->ident, strlen(p->ident)));
+    } else if (ident_timeout_ms > 0) {
+        // A username that ident did not confirm is marked as such, as on most networks
+        char username[MAX_USERNAME_LENGTH + 2];
+        int len = snprintf(username, sizeof(username), "~%s", p->username);
+        c->username = chistr_dup(chistr_make(username, len));
+    } else {
+        c->username = chistr_dup(chistr_make(p->username, strlen(p->username)));
+    }
+    c->fullName = chistr_dup(chistr_make(p->fullName, strlen(p->fullName)));
+    c->welcomeMessageSent = false;
+    outbuf_init(&c->out);
+    c->numPendingDeliveries = 0;
+    c->coalesceWindowUs = 0;
+    c->coalescedReads = 0;
+    c->logTrace = false;
+    c->logTraceGeneration = chirc_logtrace_generation() - 1;   // Forces a check on the first message
+    c->lineRxTime = p->rxTime;
+    c->initialData = chistr_dup(leftover);
+
+    pthread_t client_thread;
+    pthread_create(&client_thread, NULL, &process_client_messages, c);
+    pthread_detach(client_thread);
+}
+
+// Pending clients have no output buffer, and the main thread must never block on one of them,
+// so replies are written directly, without waiting. Returns false if the reply could not be
+// sent whole, i.e. the client is not reading its replies and should be dropped
+bool send_pending(pending_client *p, chistr data) {
+    return send(p->sockfd, data.s, data.len, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t) data.len;
+}
+
+bool send_pending_reply(pending_client *p, reply *r) {
+    r->data[r->len++] = '\r';
+    r->data[r->len++] = '\n';
+    return send_pending(p, chistr_make(r->data, r->len));
+}
+
+// Handles a line from a connection that has not registered yet. Returns false if the
+// connection should be dropped
+bool process_pending_line(pending_client *p, chistr line) {
+    if (is_keepalive(line, "PING")) {
+        if (!send_pending(p, pong_reply)) {
+            chilog_ratelimited(LOG_NET, INFO, "Dropping an unregistered connection that does not read its replies");
+            return false;
+        }
+        return true;
+    }
+    msg m;
+    parse_message(line, &m);
+    if (chistr_eq(m.command, CHISTR_LIT("NICK")) && m.numArgs >= 1) {
+        copy_arg(p->nick, sizeof(p->nick), get_arg(&m, 0));
+        chilog_sub(LOG_PARSE, INFO, "Parsed nick: %s", p->nick);
+    } else if (chistr_eq(m.command, CHISTR_LIT("NICK"))) {
+        reply r = {.len = 0};
+        reply_append(&r, CHISTR_LIT(":irc.alexbostock.co.uk " ERR_NONICKNAMEGIVEN " "));
+        reply_append(&r, p->nick[0] != '\0' ? chistr_make(p->nick, strlen(p->nick)) : CHISTR_LIT("*"));
+        reply_append(&r, CHISTR_LIT(" :No nickname given"));
+        send_pending_reply(p, &r);
+    } else if (chistr_eq(m.command, CHISTR_LIT("PASS")) && m.numArgs >= 1) {
+        // Truncating it would make it a different password, which could never match
+        if (get_arg(&m, 0).len > ACCOUNT_PASSWORD_MAX) {
+            chilog_ratelimited(LOG_NET, INFO, "Dropping an unregistered connection that sent an overlong password");
+            reply r = {.len = 0};
+            reply_append(&r, CHISTR_LIT(":irc.alexbostock.co.uk " ERR_PASSWDMISMATCH " * :Password incorrect"));
+            send_pending_reply(p, &r);
+            r.len = 0;
+            reply_append(&r, CHISTR_LIT("ERROR :Closing Link: Password too long"));
+            send_pending_reply(p, &r);
+            return false;
+        }
+        copy_arg(p->password, sizeof(p->password), get_arg(&m, 0));
+    } else if (chistr_eq(m.command, CHISTR_LIT("USER")) && m.numArgs >= 1) {
+        copy_arg(p->username, sizeof(p->username), get_arg(&m, 0));
+        copy_arg(p->fullName, sizeof(p->fullName), get_arg(&m, 3));
+        chilog_sub(LOG_PARSE, INFO, "Parsed username: %s", p->username);
+        chilog_sub(LOG_PARSE, INFO, "Parsed fullName: %s", p->fullName);
+    } else if (!is_keepalive(line, "PONG")) {
+        chilog_ratelimited(LOG_PARSE, ERROR, "Unexpected command %.*s", CHISTR_FMT(m.command));
+    }
+    return true;
+}
+
+// Password hashing is deliberately slow, so it runs on a small pool of threads rather than on the
+// main thread, which would otherwise stop accepting and serving pending connections meanwhile.
+// The number of checks in flight is bounded overall and per address, so a flood of logins to a
+// registered nick only ever costs AUTH_THREADS cores
+#define AUTH_THREADS 2
+#define AUTH_MAX_IN_FLIGHT 32
+#define AUTH_MAX_PER_ADDR 2
+
+typedef struct auth_job {
+    pending_client *p;      // Only p->password is read by the worker
+    const account *a;
+    bool ok;
+} auth_job;
+
+// Addresses of the checks in flight (0: free slot). Only used by the main thread
+static uint32_t auth_addrs[AUTH_MAX_IN_FLIGHT];
+
+// Runs on an auth worker thread
+void check_password(void *arg) {
+    auth_job *job = arg;
+    job->ok = account_check_password(job->a, job->p->password);
+}
+
+int auth_in_flight_from(uint32_t addr) {
+    int count = 0;
+    for (int i = 0; i < AUTH_MAX_IN_FLIGHT; i++) {
+        count += auth_addrs[i] == addr;
+    }
+    return count;
+}
+
+void set_auth_addr(uint32_t from, uint32_t to) {
+    for (int i = 0; i < AUTH_MAX_IN_FLIGHT; i++) {
+        if (auth_addrs[i] == from) {
+            auth_addrs[i] = to;
+            return;
+        }
+    }
+}
+
+// Called once a pending client has sent NICK and USER. If the nick is a registered account, the
+// password given with PASS is checked on the auth pool, and the client stays pending until the
+// result is collected by collect_auth_results(). Returns 0 if it is still pending, or 1 if it is
+// no longer (it has either registered, or been closed)
+int start_registration(pending_client *p, workpool *auth_pool) {
+    const account *a = account_lookup(chistr_make(p->nick, strlen(p->nick)));
+    if (a == NULL) {
+        register_client(p, chistr_make(p->line, p->lineUsed));
+        return 1;
+    }
+
+    snprintf(p->account, sizeof(p->account), "%s", a->name);    // Only used if the password check passes
+    auth_job *job = malloc(sizeof(auth_job));
+    job->p = p;
+    job->a = a;
+    if (auth_in_flight_from(p->addr) >= AUTH_MAX_PER_ADDR || workpool_submit(auth_pool, check_password, job) == -1) {
+        free(job);
+        chilog_ratelimited(LOG_NET, WARNING, "Too many password checks in flight, refusing login to %s", p->nick);
+        reply r = {.len = 0};
+        reply_append(&r, CHISTR_LIT("ERROR :Closing Link: Too many login attempts, try again later"));
+        send_pending_reply(p, &r);
+        close(p->sockfd);
+        return 1;
+    }
+    set_auth_addr(0, p->addr);
+    p->authState = AUTH_RUNNING;
+    return 0;
+}
+
+// Marks the pending clients whose password check has completed
+void collect_auth_results(workpool *auth_pool) {
+    auth_job *job;
+    while ((job = workpool_take_done(auth_pool)) != NULL) {
+        set_auth_addr(job->p->addr, 0);
+        job->p->authState = job->ok ? AUTH_PASSED : AUTH_FAILED;
+        free(job);
+    }
+}
+
+// Registers a pending client whose password check has completed, or tells it why it cannot.
+// Returns 1, as it is no longer pending either way
+int finish_registration(pending_client *p) {
+    explicit_bzero(p->password, sizeof(p->password));
+    if (p->authState == AUTH_PASSED) {
+        register_client(p, chistr_make(p->line, p->lineUsed));
+        return 1;
+    }
+    chilog_ratelimited(LOG_NET, INFO, "Wrong password for account %s", p->nick);
+    reply r = {.len = 0};
+    reply_append(&r, CHISTR_LIT(":irc.alexbostock.co.uk " ERR_PASSWDMISMATCH " "));
+    reply_append(&r, chistr_make(p->nick, strlen(p->nick)));
+    reply_append(&r, CHISTR_LIT(" :Password incorrect"));
+    send_pending_reply(p, &r);
+    r.len = 0;
+    reply_append(&r, CHISTR_LIT("ERROR :Closing Link: Password incorrect"));
+    send_pending_reply(p, &r);
+    close(p->sockfd);
+    return 1;
+}
+
+// If enabled with -i, each new connection is sent an ident query. It runs alongside the rest of
+// registration, but registration waits for it for at most ident_timeout_ms
+void start_ident_query(pending_client *p) {
+    p->ident[0] = '\0';
+    p->identUsed = 0;
+    p->identQuerySent = false;
+    p->identFd = ident_timeout_ms > 0 ? ident_connect(p->sockfd) : -1;
+    if (p->identFd != -1) {
+        set_deadline_ms(&p->identDeadline, ident_timeout_ms);
+    }
+}
+
+void end_ident_query(pending_client *p) {
+    close(p->identFd);
+    p->identFd = -1;
+}
+
+// Handles the ident query socket becoming ready. Returns the events to poll it for next, or 0
+// once the query is over (p->ident is then set if it succeeded)
+short process_ident_query(pending_client *p) {
+    if (!p->identQuerySent) {
+        if (ident_send_query(p->identFd, p->sockfd) == -1) {
+            end_ident_query(p);
+            return 0;
+        }
+        p->identQuerySent = true;
+        return POLLIN;
+    }
+
+    char *eol = NULL;
+    int bytes_read = read(p->identFd, p->identReply + p->identUsed, IDENT_REPLY_MAX - p->identUsed);
+    if (bytes_read == -1 && (errno == EINTR || errno == EAGAIN)) {
+        return POLLIN;
+    }
+    if (bytes_read > 0) {
+        p->identUsed += bytes_read;
+        eol = memchr(p->identReply, '\n', p->identUsed);
+        if (eol == NULL && p->identUsed < IDENT_REPLY_MAX) {
+            return POLLIN;
+        }
+    }
+    // The reply is complete, too long, or cut short by the ident service closing the connection
+    int len = eol != NULL ? eol - p->identReply : p->identUsed;
+    if (len > 0 && p->identReply[len - 1] == '\r') {
+        len--;
+    }
+    if (ident_parse_reply(chistr_make(p->identReply, len), p->ident, sizeof(p->ident))) {
+        chilog_sub(LOG_NET, DEBUG, "Ident user id: %s", p->ident);
+    }
+    end_ident_query(p);
+    return 0;
+}
+
+// Drops a connection that did not register within REGISTRATION_TIMEOUT. Returns 1, as it is no
+// longer pending
+int expire_pending_client(pending_client *p) {
+    chilog_ratelimited(LOG_NET, INFO, "Dropping a connection that did not register in time");
+    send_pending(p, CHISTR_LIT("ERROR :Closing Link: Registration timed out\r\n"));
+    close(p->sockfd);
+    return 1;
+}
+
+// Reads from a connection that has not registered yet. Returns 0 if it is still pending, or 1 if
+// it is no longer (it has either registered, or been closed)
+int process_pending_client(pending_client *p, workpool *auth_pool) {
+    int bytes_read = read(p->sockfd, p->line + p->lineUsed, MAX_MESSAGE_LENGTH - p->lineUsed);
+    if (bytes_read == -1 && errno == EINTR) {
+        return 0;
+    }
+    if (bytes_read <= 0) {
+        close(p->sockfd);
+        return 1;
+    }
+    clock_gettime(CLOCK_REALTIME, &p->rxTime);
+    p->lineUsed += bytes_read;
+
+    int line_start = 0;
+    for (int i = 1; i < p->lineUsed; i++) {
+        if (p->line[i - 1] != '\r' || p->line[i] != '\n') {
+            continue;
+        }
+        if (!process_pending_line(p, chistr_make(p->line + line_start, i - 1 - line_start))) {
+            close(p->sockfd);
+            return 1;
+        }
+        line_start = i + 1;
+        if (p->nick[0] != '\0' && p->username[0] != '\0') {
+            // Keeps whatever was received after this line for the client thread
+            memmove(p->line, p->line + line_start, p->lineUsed - line_start);
+            p->lineUsed -= line_start;
+            p->registering = true;
+            return p->identFd != -1 ? 0 : start_registration(p, auth_pool);
+        }
+    }
+    if (line_start == 0 && p->lineUsed == MAX_MESSAGE_LENGTH) {
+        chilog_ratelimited(LOG_NET, WARNING, "Buffer full of an oversized / invalid message. Dropping buffered data");
+        line_start = MAX_MESSAGE_LENGTH;
+    }
+    memmove(p->line, p->line + line_start, p->lineUsed - line_start);
+    p->lineUsed -= line_start;
+    return 0;
+}
+
+// Accepts connections and serves them until they register. Runs on the main thread
+void run_server(int sockfd) {
+    workpool *auth_pool = workpool_create(AUTH_THREADS, AUTH_MAX_IN_FLIGHT);
+    if (auth_pool == NULL) {
+        chilog(CRITICAL, "Failed to create the auth worker pool");
+        exit(1);
+    }
+
+    motd_init(MOTD_FILE, "irc.alexbostock.co.uk");
+
+    // pfds[0] is the listening socket and pfds[1] the auth pool. Each pending client then has two
+    // entries: pfds[2 + 2 * k] is the connection of pending[k], and pfds[3 + 2 * k] its ident query
+    int num_pending = 0, max_pending = 16;
+    pending_client **pending = malloc(max_pending * sizeof(pending_client *));
+    struct pollfd *pfds = malloc((2 + 2 * max_pending) * sizeof(struct pollfd));
+    pfds[0].fd = sockfd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = workpool_notify_fd(auth_pool);
+    pfds[1].events = POLLIN;
+    int timeout_ms = -1;    // Until the earliest registration or ident deadline
+
+    while (1) {
+        if (poll(pfds, 2 + 2 * num_pending, timeout_ms) == -1) {
+            continue;
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            collect_auth_results(auth_pool);
+        }
+
+        timeout_ms = -1;
+        for (int k = num_pending - 1; k >= 0; k--) {
+            pending_client *p = pending[k];
+            struct pollfd *conn_pfd = &pfds[2 + 2 * k], *ident_pfd = &pfds[3 + 2 * k];
+            if (ident_pfd->fd != -1 && ident_pfd->revents != 0) {
+                ident_pfd->events = process_ident_query(p);
+            }
+            if (p->identFd != -1 && timespec_until_us(&p->identDeadline) <= 0) {
+                chilog_sub(LOG_NET, DEBUG, "Ident query timed out");
+                end_ident_query(p);
+            }
+            ident_pfd->fd = p->identFd;
+
+            int done;
+            if (p->authState == AUTH_PASSED || p->authState == AUTH_FAILED) {
+                done = finish_registration(p);
+            } else if (p->authState != AUTH_RUNNING && timespec_until_us(&p->registrationDeadline) <= 0) {
+                done = expire_pending_client(p);
+            } else if (p->registering) {
+                done = p->identFd == -1 && p->authState == AUTH_NONE ? start_registration(p, auth_pool) : 0;
+            } else {
+                done = conn_pfd->revents != 0 ? process_pending_client(p, auth_pool) : 0;
+            }
+            if (!done) {
+                if (p->registering) {
+                    conn_pfd->fd = -1;  // Ignores the connection until its registration completes
+                }
+                if (p->authState != AUTH_RUNNING) {
+                    poll_until(&timeout_ms, &p->registrationDeadline);
+                }
+                if (p->identFd != -1) {
+                    poll_until(&timeout_ms, &p->identDeadline);
+                }
+                continue;
+            }
+            if (p->identFd != -1) {
+                end_ident_query(p);
+            }
+            free(p);
+            num_pending--;
+            pending[k] = pending[num_pending];
+            pfds[2 + 2 * k] = pfds[2 + 2 * num_pending];
+            pfds[3 + 2 * k] = pfds[3 + 2 * num_pending];
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            int client_sockfd;
+            struct sockaddr_in addr;
+            socklen_t addr_len = sizeof(addr);
+            while ((client_sockfd = accept(sockfd, (struct sockaddr *) &addr, &addr_len)) != -1) {
+                if (num_pending == max_pending) {
+                    max_pending *= 2;
+                    pending = realloc(pending, max_pending * sizeof(pending_client *));
+                    pfds = realloc(pfds, (2 + 2 * max_pending) * sizeof(struct pollfd));
+                }
+                pending_client *p = malloc(sizeof(pending_client));
+                p->sockfd = client_sockfd;
+                p->lineUsed = 0;
+                p->nick[0] = p->username[0] = p->fullName[0] = p->password[0] = p->account[0] = '\0';
+                p->addr = addr.sin_addr.s_addr;
+                p->authState = AUTH_NONE;
+                p->registering = false;
+                set_deadline_ms(&p->registrationDeadline, REGISTRATION_TIMEOUT * 1000L);
+                poll_until(&timeout_ms, &p->registrationDeadline);
+                start_ident_query(p);
+                if (p->identFd != -1) {
+                    poll_until(&timeout_ms, &p->identDeadline);
+                }
+                pending[num_pending] = p;
+                pfds[2 + 2 * num_pending].fd = client_sockfd;
+                pfds[2 + 2 * num_pending].events = POLLIN;
+                pfds[3 + 2 * num_pending].fd = p->identFd;
+                pfds[3 + 2 * num_pending].events = POLLOUT;
+                num_pending++;
+                addr_len = sizeof(addr);
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                chilog_ratelimited(LOG_NET, ERROR, "Failed to accept incoming connection");
+            }
+        }
+    }
+}
+
+// Signals are handled by a dedicated thread, so this must be called before any other thread is created
+void start_signal_thread() {
+    static sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_t signal_thread;
+    pthread_create(&signal_thread, NULL, &handle_signals, &signals);
+}
+
+// Multi-process mode (-w N): N worker processes share the listening socket, and each one runs
+// its own server. A crashing worker only takes down its own connections; the parent restarts it.
+// Workers do not share any state, since this server does not keep any across connections yet
+pid_t start_worker(int sockfd, int index) {
+    chirc_logflush();   // Otherwise the child would write out the parent's buffered log messages again
+    pid_t pid = fork();
+    if (pid == -1) {
+        chilog(ERROR, "Failed to start worker %i", index);
+        return -1;
+    }
+    if (pid > 0) {
+        return pid;
+    }
+
+    chirc_logreset();
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGCHLD);
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+    if (metrics_file != NULL) {
+        char *worker_metrics_file;
+        if (asprintf(&worker_metrics_file, "%s.%i", metrics_file, index) != -1) {
+            metrics_file = worker_metrics_file;
+        }
+    }
+    start_signal_thread();
+    run_server(sockfd);
+    exit(0);
+}
+
+// Minimum number of seconds between two starts of the same worker, so that a worker that
+// crashes on startup is not restarted in a tight fork loop
+#define WORKER_RESTART_DELAY 1
+
+// Runs in the parent process: starts the workers, restarts any that die, and forwards
+// SIGHUP / SIGUSR1 / SIGUSR2 to them
+void supervise_workers(int sockfd) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    pid_t *workers = malloc(num_workers * sizeof(pid_t));     // -1 while waiting to be restarted
+    time_t *started = malloc(num_workers * sizeof(time_t));
+    for (int i = 0; i < num_workers; i++) {
+        workers[i] = start_worker(sockfd, i);
+        started[i] = time(NULL);
+    }
+    chilog(INFO, "Started %i worker processes", num_workers);
+
+    // Wakes up every second to restart workers and flush the log, even without signals
+    struct timespec tick = {1, 0};
+    while (true) {
+        int sig = sigtimedwait(&signals, NULL, &tick);
+        if (sig == SIGCHLD) {
+            pid_t pid;
+            int status;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                for (int i = 0; i < num_workers; i++) {
+                    if (workers[i] == pid) {
+                        chilog(ERROR, "Worker %i (pid %i) exited with status %i, restarting it", i, pid, status);
+                        workers[i] = -1;
+                    }
+                }
+            }
+        } else if (sig != -1) {
+            for (int i = 0; i < num_workers; i++) {
+                if (workers[i] > 0) {
+                    kill(workers[i], sig);
+                }
+            }
+        }
+
+        time_t now = time(NULL);
+        for (int i = 0; i < num_workers; i++) {
+            if (workers[i] == -1 && now - started[i] >= WORKER_RESTART_DELAY) {
+                workers[i] = start_worker(sockfd, i);
+                started[i] = now;
+            }
+        }
+        chirc_logflush_ratelimited();
+        chirc_logflush_idle();
     }
 }
 
@@ -137,7 +1062,7 @@ int main(int argc, char *argv[]) {
     char *port = "6667", *passwd = NULL, *servername = NULL, *network_file = NULL;
     int verbosity = 0;
 
-    while ((opt = getopt(argc, argv, "p:o:s:n:vqh")) != -1)
+    while ((opt = getopt(argc, argv, "p:o:s:n:L:D:M:c:w:a:i:tvqh")) != -1)
         switch (opt) {
         case 'p':
             port = strdup(optarg);
@@ -155,6 +1080,30 @@ int main(int argc, char *argv[]) {
             }
             network_file = strdup(optarg);
             break;
+        case 'L':
+            logconf_file = strdup(optarg);
+            break;
+        case 'D':
+            log_dir = strdup(optarg);
+            break;
+        case 'M':
+            metrics_file = strdup(optarg);
+            break;
+        case 't':
+            measure_latency = true;
+            break;
+        case 'c':
+            coalesce_max_us = atol(optarg);
+            break;
+        case 'w':
+            num_workers = atoi(optarg);
+            break;
+        case 'a':
+            accounts_file = strdup(optarg);
+            break;
+        case 'i':
+            ident_timeout_ms = atol(optarg);
+            break;
         case 'v':
             verbosity++;
             break;
@@ -162,7 +1111,7 @@ int main(int argc, char *argv[]) {
             verbosity = -1;
             break;
         case 'h':
-            printf("Usage: chirc -o OPER_PASSWD [-p PORT] [-s SERVERNAME] [-n NETWORK_FILE] [(-q|-v|-vv)]\n");
+            printf("Usage: chirc -o OPER_PASSWD [-p PORT] [-s SERVERNAME] [-n NETWORK_FILE] [-L LOG_CONF] [-D LOG_DIR] [-M METRICS_FILE] [-t] [-c MAX_COALESCE_US] [-w WORKERS] [-a ACCOUNTS_FILE] [-i IDENT_TIMEOUT_MS] [(-q|-v|-vv)]\n");
             exit(0);
             break;
         default:
@@ -198,6 +1147,17 @@ int main(int argc, char *argv[]) {
         chirc_setloglevel(TRACE);
         break;
     }
+    if (log_dir != NULL && chirc_setlogdir(log_dir) == -1) {
+        fprintf(stderr, "ERROR: Could not log to directory %s\n", log_dir);
+        exit(-1);
+    }
+    chirc_logthread_dedicated();
+    if (logconf_file != NULL) {
+        chirc_loadlogconf(logconf_file);
+    }
+    if (accounts_file != NULL) {
+        account_store_load(accounts_file);
+    }
 
     uint16_t port_number = atoi(port);
     if (port_number == 0 || port_number > 49151) {
@@ -219,28 +1179,20 @@ int main(int argc, char *argv[]) {
         chilog(CRITICAL, "Failed to bind socket");
         exit(1);
     }
+    // Don't wake up for a connection until it has sent something
+    int defer_accept_secs = DEFER_ACCEPT_TIMEOUT;
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept_secs, sizeof(defer_accept_secs)) == -1) {
+        chilog_sub(LOG_NET, WARNING, "Could not enable TCP_DEFER_ACCEPT");
+    }
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
     listen(sockfd, 5);
     chilog(INFO, "Listening on port:");
     chilog(INFO, port);
 
-    while (1) {
-        // Receive incoming connections
-
-        client *c = malloc(sizeof(client));
-        c->nick = NULL;
-        c->username = NULL;
-        c->fullName = NULL;
-        c->welcomeMessageSent = false;
-
-        struct sockaddr client_addr;    // TODO: look at moving this to the heap
-        socklen_t client_addr_len;
-        c->sockfd = accept(sockfd, &client_addr, &client_addr_len);
-        if (c->sockfd == -1) {
-            chilog(ERROR, "Failed to accept incoming connection");
-            exit(1);
-        }
-
-        pthread_t client_thread;
-        int iret = pthread_create(&client_thread, NULL, &process_client_messages, c);
+    if (num_workers > 0) {
+        supervise_workers(sockfd);
+    } else {
+        start_signal_thread();
+        run_server(sockfd);
     }
 }
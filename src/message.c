@@ -1,66 +1,69 @@
+#include "chistr.h"
+
+// RFC 2812 allows at most 15 parameters
+#define MAX_ARGS 15
+
+// A parsed message. All strings are slices of the line that was parsed,
+// so a msg is only valid while that line is being processed
 typedef struct msg {
-    char *command;
-    char **args;
+    chistr tags;        // IRCv3 message tags (without the leading @), or CHISTR_NULL
+    chistr command;
+    chistr args[MAX_ARGS];
     int numArgs;
 } msg;
 
-msg *parse_message(char *message_str, int message_length) {
-    // First pass: count arguments
-    msg *m = malloc(sizeof(msg));
+void parse_message(chistr line, msg *m) {
+    const char *str = line.s;
+    size_t length = line.len;
+    size_t offset = 0;
+
+    m->tags = CHISTR_NULL;
+    m->command = CHISTR_NULL;
     m->numArgs = 0;
-    for (int offset = 0; offset < message_length; offset++) {
-        if (message_str[offset] == ' ') {
-            m->numArgs++;
-        } else if (message_str[offset] == ':') {
-            break;
+
+    if (length > 0 && str[0] == '@') {
+        offset = 1;
+        while (offset < length && str[offset] != ' ') {
+            offset++;
         }
+        m->tags = chistr_make(str + 1, offset - 1);
     }
-    m->args = malloc(m->numArgs * sizeof(char *));
-    // Second pass: collect arguments
-    int offset = 0;
-    for (int arg_number = -1; arg_number < m->numArgs; arg_number++) {
-        int start_offset = offset;
-        for (; offset < message_length; offset++) {
-            if (message_str[offset] == ':') {
+
+    for (int arg_number = -1; arg_number < MAX_ARGS; arg_number++) {
+        while (offset < length && str[offset] == ' ') {
+            offset++;
+        }
+        if (offset == length) {
+            break;
+        }
+        size_t start_offset = offset;
+        if (arg_number >= 0 && (str[offset] == ':' || arg_number == MAX_ARGS - 1)) {
+            // Trailing parameter: the rest of the line
+            if (str[offset] == ':') {
                 start_offset++;
-                offset = message_length + 1;
-                break;
-            } else if (message_str[offset] == ' ') {
+            }
+            offset = length;
+        } else {
+            while (offset < length && str[offset] != ' ') {
                 offset++;
-                break;
             }
         }
-        if (offset == message_length) {
-            offset++;
-        }
-        int arg_len = offset - start_offset;    // Including null-terminator
-        chilog(DEBUG, "%i - %i: %i", start_offset, offset, arg_len);
-        char *arg = malloc(arg_len * sizeof(char));
-        memcpy(arg, &message_str[start_offset], arg_len - 1);
-        arg[arg_len - 1] = '\0';
-        chilog(DEBUG, "Arg: %s", arg);
+        chistr arg = chistr_make(str + start_offset, offset - start_offset);
+        chilog_sampled(LOG_PARSE, DEBUG, "Arg: %.*s", CHISTR_FMT(arg));
         if (arg_number == -1) {
             m->command = arg;
         } else {
             m->args[arg_number] = arg;
+            m->numArgs++;
         }
     }
-    return m;
 }
 
-// Args should only be fetched using get_arg, and must not be fetched more than once
-char *get_arg(msg *m, int arg_index) {
-    char *arg = m->args[arg_index];
-    m->args[arg_index] = NULL;      // Used to avoid freeing memory used by caller
-    return arg;
-}
-
-void free_message(msg *m) {
-    for (int i = 0; i < m->numArgs; i++) {
-        if (m->args[i] != NULL) {
-            free(m->args[i]);
-        }
+// Returns CHISTR_NULL if the message does not have that many arguments.
+// The result borrows from the parsed line, so use chistr_dup to keep it
+chistr get_arg(msg *m, int arg_index) {
+    if (arg_index >= m->numArgs) {
+        return CHISTR_NULL;
     }
-    free(m->args);
-    free(m);
+    return m->args[arg_index];
 }
@@ -0,0 +1,225 @@
+/*
+ *  chirc: a simple multi-threaded IRC server
+ *
+ *  Message of the day
+ *
+ *  see motd.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+#include "motd.h"
+#include "reply.h"
+#include "log.h"
+
+/* Keeps every RPL_MOTD line within the 512 byte limit, whatever the nick */
+#define MOTD_LINE_MAX 400
+
+static pthread_mutex_t motd_lock = PTHREAD_MUTEX_INITIALIZER;
+static motd *current_motd = NULL;   /* Holds a reference. Protected by motd_lock */
+static char *motd_path = NULL;
+static char *motd_name = NULL;      /* Basename of motd_path, as reported by inotify */
+static char *motd_servername = NULL;
+static int motd_inotify_fd = -1;
+
+typedef struct motd_builder {
+    char *data;
+    size_t len, size;
+    size_t *nick_offsets;           /* Where the nick goes */
+    int num_nicks, max_nicks;
+} motd_builder;
+
+static void append(motd_builder *b, const char *s, size_t len)
+{
+    if (b->len + len > b->size) {
+        while (b->len + len > b->size)
+            b->size *= 2;
+        b->data = realloc(b->data, b->size);
+    }
+    memcpy(b->data + b->len, s, len);
+    b->len += len;
+}
+
+/* Appends ":<server> <code> ", then marks where the nick goes */
+static void append_prefix(motd_builder *b, const char *code)
+{
+    append(b, ":", 1);
+    append(b, motd_servername, strlen(motd_servername));
+    append(b, " ", 1);
+    append(b, code, strlen(code));
+    append(b, " ", 1);
+    if (b->num_nicks == b->max_nicks) {
+        b->max_nicks *= 2;
+        b->nick_offsets = realloc(b->nick_offsets, b->max_nicks * sizeof(size_t));
+    }
+    b->nick_offsets[b->num_nicks++] = b->len;
+}
+
+static void append_str(motd_builder *b, const char *s)
+{
+    append(b, s, strlen(s));
+}
+
+static motd *render(const char *text, size_t len, bool missing)
+{
+    motd_builder b = {.len = 0, .size = 1024, .num_nicks = 0, .max_nicks = 16};
+    b.data = malloc(b.size);
+    b.nick_offsets = malloc(b.max_nicks * sizeof(size_t));
+
+    if (missing) {
+        append_prefix(&b, ERR_NOMOTD);
+        append_str(&b, " :MOTD File is missing\r\n");
+    } else {
+        append_prefix(&b, RPL_MOTDSTART);
+        append_str(&b, " :- ");
+        append_str(&b, motd_servername);
+        append_str(&b, " Message of the day - \r\n");
+
+        const char *line = text, *end = text + len;
+        while (line < end) {
+            const char *eol = memchr(line, '\n', end - line);
+            const char *next = eol != NULL ? eol + 1 : end;
+            if (eol == NULL)
+                eol = end;
+            if (eol > line && eol[-1] == '\r')
+                eol--;
+            size_t line_len = eol - line < MOTD_LINE_MAX ? (size_t) (eol - line) : MOTD_LINE_MAX;
+
+            append_prefix(&b, RPL_MOTD);
+            append_str(&b, " :- ");
+            append(&b, line, line_len);
+            append_str(&b, "\r\n");
+            line = next;
+        }
+
+        append_prefix(&b, RPL_ENDOFMOTD);
+        append_str(&b, " :End of MOTD command\r\n");
+    }
+
+    motd *m = malloc(sizeof(motd));
+    atomic_init(&m->refs, 1);
+    m->data = b.data;
+    m->num_nicks = b.num_nicks;
+    m->segments = malloc((b.num_nicks + 1) * sizeof(chistr));
+    size_t start = 0;
+    for (int i = 0; i < b.num_nicks; i++) {
+        m->segments[i] = chistr_make(b.data + start, b.nick_offsets[i] - start);
+        start = b.nick_offsets[i];
+    }
+    m->segments[b.num_nicks] = chistr_make(b.data + start, b.len - start);
+    free(b.nick_offsets);
+    return m;
+}
+
+/* Reads the whole file with read() rather than mmap(): the file may be
+ * truncated while it is being loaded, which would fault on a mapping */
+static motd *load(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return render(NULL, 0, true);
+
+    size_t len = 0, size = 4096;
+    char *text = malloc(size);
+    while (true) {
+        if (len == size) {
+            size *= 2;
+            text = realloc(text, size);
+        }
+        ssize_t n = read(fd, text + len, size - len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            chilog(ERROR, "Could not read MOTD file %s", path);
+            close(fd);
+            free(text);
+            return render(NULL, 0, true);
+        }
+        if (n == 0)
+            break;
+        len += n;
+    }
+    close(fd);
+
+    motd *m = render(text, len, false);
+    free(text);
+    return m;
+}
+
+/* Drains the inotify queue. Returns true if any event was about the MOTD file */
+static bool file_changed()
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t len;
+
+    while ((len = read(motd_inotify_fd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + len; ) {
+            struct inotify_event *event = (struct inotify_event *) p;
+            if (event->len > 0 && strcmp(event->name, motd_name) == 0)
+                changed = true;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return changed;
+}
+
+void motd_init(const char *path, const char *servername)
+{
+    char *dir_copy = strdup(path), *name_copy = strdup(path);
+
+    pthread_mutex_lock(&motd_lock);
+    motd_path = strdup(path);
+    motd_name = strdup(basename(name_copy));
+    motd_servername = strdup(servername);
+
+    /* Watches the directory, so that the file being created or replaced is noticed too */
+    motd_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (motd_inotify_fd != -1 && inotify_add_watch(motd_inotify_fd, dirname(dir_copy),
+            IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) == -1) {
+        close(motd_inotify_fd);
+        motd_inotify_fd = -1;
+    }
+    if (motd_inotify_fd == -1)
+        chilog(WARNING, "Could not watch MOTD file %s for changes", path);
+
+    current_motd = load(motd_path);
+    pthread_mutex_unlock(&motd_lock);
+    free(dir_copy);
+    free(name_copy);
+}
+
+const motd *motd_acquire()
+{
+    pthread_mutex_lock(&motd_lock);
+    if (motd_inotify_fd != -1 && file_changed()) {
+        chilog(INFO, "MOTD file %s changed, reloading it", motd_path);
+        motd_release(current_motd);
+        current_motd = load(motd_path);
+    }
+    motd *m = current_motd;
+    atomic_fetch_add(&m->refs, 1);
+    pthread_mutex_unlock(&motd_lock);
+    return m;
+}
+
+void motd_release(const motd *m)
+{
+    motd *mut = (motd *) m;
+
+    if (atomic_fetch_sub(&mut->refs, 1) == 1) {
+        free(mut->segments);
+        free(mut->data);
+        free(mut);
+    }
+}
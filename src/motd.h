@@ -0,0 +1,69 @@
+/*
+ *
+ *  chirc: a simple multi-threaded IRC server
+ *
+ *  Message of the day
+ *
+ *  The MOTD file is read once and rendered into the complete
+ *  reply sequence: RPL_MOTDSTART, one RPL_MOTD per line, RPL_ENDOFMOTD
+ *  (or ERR_NOMOTD if there is no file). Every line of that sequence
+ *  contains the nick of the recipient, so the rendering is kept as
+ *  segments of one buffer with the nick going between each pair of
+ *  consecutive segments:
+ *
+ *    ":srv 375 " <nick> " :- srv Message of the day - \r\n:srv 372 " <nick> ...
+ *
+ *  The rendering is shared read-only by all clients and reference
+ *  counted, so it can be replaced while clients are sending it. It is
+ *  only re-rendered when inotify reports that the file has changed.
+ *
+ */
+
+#ifndef CHIRC_MOTD_H_
+#define CHIRC_MOTD_H_
+
+#include <stdatomic.h>
+
+#include "chistr.h"
+
+typedef struct motd {
+    atomic_int refs;
+    int num_nicks;          /* Number of places the nick goes */
+    chistr *segments;       /* num_nicks + 1 segments of data */
+    char *data;
+} motd;
+
+
+/*
+ * motd_init - Renders the MOTD and starts watching the file for changes
+ *
+ * The watch belongs to the calling process, so a process that forks
+ * workers must call this in each worker.
+ *
+ * path: Path of the MOTD file. It does not need to exist yet.
+ *
+ * servername: Server name used as the prefix of the replies
+ *
+ * Returns: nothing. If the file cannot be watched, the MOTD is rendered
+ *          once and never reloaded.
+ */
+void motd_init(const char *path, const char *servername);
+
+
+/*
+ * motd_acquire - Returns the current MOTD rendering
+ *
+ * Re-renders it first if the file has changed since the last call.
+ *
+ * Returns: the rendering. It must be released with motd_release().
+ */
+const motd *motd_acquire();
+
+
+/*
+ * motd_release - Releases a rendering returned by motd_acquire()
+ */
+void motd_release(const motd *m);
+
+
+#endif /* CHIRC_MOTD_H_ */
@@ -0,0 +1,166 @@
+/*
+ *  chirc: a simple multi-threaded IRC server
+ *
+ *  Output buffers
+ *
+ *  see outbuf.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "outbuf.h"
+
+/* Per-thread freelists, one per size class */
+typedef struct chunk_pool {
+    outbuf_chunk *free;
+    int num_free;
+    int max_free;
+    size_t chunk_size;
+} chunk_pool;
+
+static _Thread_local chunk_pool small_pool = {NULL, 0, OUTBUF_POOL_SMALL_MAX, OUTBUF_SMALL_CHUNK};
+static _Thread_local chunk_pool large_pool = {NULL, 0, OUTBUF_POOL_LARGE_MAX, OUTBUF_LARGE_CHUNK};
+
+static outbuf_chunk *chunk_get(chunk_pool *pool)
+{
+    outbuf_chunk *chunk = pool->free;
+
+    if (chunk != NULL) {
+        pool->free = chunk->next;
+        pool->num_free--;
+    } else {
+        chunk = malloc(sizeof(outbuf_chunk) + pool->chunk_size);
+        chunk->size = pool->chunk_size;
+    }
+    chunk->next = NULL;
+    chunk->start = chunk->end = 0;
+    return chunk;
+}
+
+static void chunk_put(outbuf_chunk *chunk)
+{
+    chunk_pool *pool = chunk->size == OUTBUF_LARGE_CHUNK ? &large_pool : &small_pool;
+
+    if (pool->num_free >= pool->max_free) {
+        free(chunk);
+        return;
+    }
+    chunk->next = pool->free;
+    pool->free = chunk;
+    pool->num_free++;
+}
+
+void outbuf_init(outbuf *ob)
+{
+    ob->head = ob->tail = NULL;
+    ob->queued = 0;
+}
+
+void outbuf_append(outbuf *ob, chistr data)
+{
+    const char *src = data.s;
+    size_t len = data.len;
+
+    while (len > 0) {
+        outbuf_chunk *tail = ob->tail;
+
+        if (tail == NULL || tail->end == tail->size) {
+            tail = chunk_get(ob->queued >= OUTBUF_LARGE_THRESHOLD ? &large_pool : &small_pool);
+            if (ob->tail == NULL)
+                ob->head = tail;
+            else
+                ob->tail->next = tail;
+            ob->tail = tail;
+        }
+
+        size_t space = tail->size - tail->end;
+        size_t n = len < space ? len : space;
+        memcpy(tail->data + tail->end, src, n);
+        tail->end += n;
+        ob->queued += n;
+        src += n;
+        len -= n;
+    }
+}
+
+/* Returns fully written chunks at the head of the chain to the pool */
+static void release_written(outbuf *ob)
+{
+    while (ob->head != NULL && ob->head->start == ob->head->end) {
+        outbuf_chunk *chunk = ob->head;
+        ob->head = chunk->next;
+        chunk_put(chunk);
+    }
+    if (ob->head == NULL)
+        ob->tail = NULL;
+}
+
+int outbuf_flush(outbuf *ob, int fd)
+{
+    struct iovec iov[OUTBUF_MAX_IOV];
+
+    while (ob->head != NULL) {
+        struct msghdr mh = {.msg_iov = iov};
+        outbuf_chunk *chunk = ob->head;
+
+        for (; chunk != NULL && mh.msg_iovlen < OUTBUF_MAX_IOV; chunk = chunk->next) {
+            iov[mh.msg_iovlen].iov_base = chunk->data + chunk->start;
+            iov[mh.msg_iovlen].iov_len = chunk->end - chunk->start;
+            mh.msg_iovlen++;
+        }
+
+        /* MSG_NOSIGNAL: a peer that went away must not kill the server with SIGPIPE */
+        ssize_t written = sendmsg(fd, &mh, MSG_NOSIGNAL);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            int saved_errno = errno;
+            outbuf_clear(ob);
+            errno = saved_errno;
+            return -1;
+        }
+
+        ob->queued -= written;
+        for (chunk = ob->head; written > 0; chunk = chunk->next) {
+            size_t n = chunk->end - chunk->start;
+            if (n > written)
+                n = written;
+            chunk->start += n;
+            written -= n;
+        }
+        release_written(ob);
+    }
+    return 0;
+}
+
+void outbuf_clear(outbuf *ob)
+{
+    while (ob->head != NULL) {
+        outbuf_chunk *chunk = ob->head;
+        ob->head = chunk->next;
+        chunk_put(chunk);
+    }
+    ob->tail = NULL;
+    ob->queued = 0;
+}
+
+static void pool_release(chunk_pool *pool)
+{
+    while (pool->free != NULL) {
+        outbuf_chunk *chunk = pool->free;
+        pool->free = chunk->next;
+        free(chunk);
+    }
+    pool->num_free = 0;
+}
+
+void outbuf_pool_release()
+{
+    pool_release(&small_pool);
+    pool_release(&large_pool);
+}
@@ -0,0 +1,114 @@
+/*
+ *
+ *  chirc: a simple multi-threaded IRC server
+ *
+ *  Output buffers
+ *
+ *  Data sent to a connection is appended to its output buffer, which is
+ *  a chain of fixed-size chunks, and written out with a single sendmsg
+ *  call per flush (each chunk maps onto one iovec).
+ *
+ *  Chunks come in two size classes (OUTBUF_SMALL_CHUNK and
+ *  OUTBUF_LARGE_CHUNK; large chunks are only used once a lot of data is
+ *  queued) and are taken from per-thread freelists, to which they are
+ *  returned once flushed. An output buffer must only be used by one
+ *  thread, so no locking is needed and, once a thread's freelists are
+ *  warm, appending and flushing never call the allocator.
+ *
+ */
+
+#ifndef CHIRC_OUTBUF_H_
+#define CHIRC_OUTBUF_H_
+
+#include <stddef.h>
+
+#include "chistr.h"
+
+#define OUTBUF_SMALL_CHUNK (4 * 1024)
+#define OUTBUF_LARGE_CHUNK (64 * 1024)
+
+/* Large chunks are used for new chunks once this much data is queued */
+#define OUTBUF_LARGE_THRESHOLD OUTBUF_LARGE_CHUNK
+
+/* Maximum number of free chunks kept per thread, per size class */
+#define OUTBUF_POOL_SMALL_MAX (64)
+#define OUTBUF_POOL_LARGE_MAX (8)
+
+/* Maximum number of chunks written by a single sendmsg call */
+#define OUTBUF_MAX_IOV (64)
+
+typedef struct outbuf_chunk {
+    struct outbuf_chunk *next;
+    size_t size;        /* Capacity of data */
+    size_t start;       /* Offset of the first byte not yet written */
+    size_t end;         /* Offset of the first free byte */
+    char data[];
+} outbuf_chunk;
+
+typedef struct outbuf {
+    outbuf_chunk *head;
+    outbuf_chunk *tail;
+    size_t queued;      /* Bytes appended but not yet written */
+} outbuf;
+
+
+/*
+ * outbuf_init - Initialises an empty output buffer
+ *
+ * ob: The output buffer
+ *
+ * Returns: Nothing.
+ */
+void outbuf_init(outbuf *ob);
+
+
+/*
+ * outbuf_append - Appends data to an output buffer
+ *
+ * ob: The output buffer
+ *
+ * data: Data to append. It is copied, so it does not need to outlive
+ *       the call.
+ *
+ * Returns: Nothing.
+ */
+void outbuf_append(outbuf *ob, chistr data);
+
+
+/*
+ * outbuf_flush - Writes all queued data to a socket
+ *
+ * Blocks until everything is written (or an error occurs). Written
+ * chunks are returned to the calling thread's freelists.
+ *
+ * ob: The output buffer
+ *
+ * fd: The socket to write to
+ *
+ * Returns: 0 on success, -1 on error (errno is set, and the data that
+ *          could not be written is discarded).
+ */
+int outbuf_flush(outbuf *ob, int fd);
+
+
+/*
+ * outbuf_clear - Discards all queued data
+ *
+ * ob: The output buffer
+ *
+ * Returns: Nothing.
+ */
+void outbuf_clear(outbuf *ob);
+
+
+/*
+ * outbuf_pool_release - Frees the calling thread's free chunks
+ *
+ * Should be called by a thread that uses output buffers before it exits.
+ *
+ * Returns: Nothing.
+ */
+void outbuf_pool_release();
+
+
+#endif /* CHIRC_OUTBUF_H_ */
@@ -0,0 +1,116 @@
+/*
+ *  chirc: a simple multi-threaded IRC server
+ *
+ *  Server statistics
+ *
+ *  see stats.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include "stats.h"
+#include "log.h"
+
+typedef struct {
+    atomic_ulong buckets[LATENCY_BUCKETS + 1];
+    atomic_ulong count;
+    atomic_ulong sum_us;
+} latency_histogram_t;
+
+static latency_histogram_t delivery_latency[NUM_DELIVERY_PATHS];
+
+/* Output flushes */
+static atomic_ulong flush_count;
+static atomic_ulong flush_bytes;
+static latency_histogram_t coalesce_window;
+
+static const char *delivery_path_names[NUM_DELIVERY_PATHS] = {
+    "local", "relayed"
+};
+
+static void histogram_record(latency_histogram_t *h, long us)
+{
+    int bucket = 0;
+
+    if (us < 0)
+        us = 0;
+    while (bucket < LATENCY_BUCKETS && us > (1L << bucket))
+        bucket++;
+
+    atomic_fetch_add_explicit(&h->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_us, us, memory_order_relaxed);
+}
+
+static long elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+void stats_record_delivery(delivery_path_t path, const struct timespec *rx_time)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    histogram_record(&delivery_latency[path], elapsed_us(rx_time, &now));
+}
+
+void stats_record_flush(size_t bytes, long window_us)
+{
+    atomic_fetch_add_explicit(&flush_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&flush_bytes, bytes, memory_order_relaxed);
+    histogram_record(&coalesce_window, window_us);
+}
+
+static void histogram_write(FILE *f, const char *name, const char *labels, latency_histogram_t *h)
+{
+    unsigned long cumulative = 0;
+
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        cumulative += atomic_load_explicit(&h->buckets[bucket], memory_order_relaxed);
+        fprintf(f, "%s_bucket{%s,le=\"%.6f\"} %lu\n", name, labels, (1L << bucket) / 1e6, cumulative);
+    }
+    cumulative += atomic_load_explicit(&h->buckets[LATENCY_BUCKETS], memory_order_relaxed);
+    fprintf(f, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, labels, cumulative);
+    fprintf(f, "%s_sum{%s} %.6f\n", name, labels,
+            atomic_load_explicit(&h->sum_us, memory_order_relaxed) / 1e6);
+    fprintf(f, "%s_count{%s} %lu\n", name, labels, cumulative);
+}
+
+int stats_write_metrics(const char *path)
+{
+    char tmp_path[4096];
+    char labels[64];
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *f = fopen(tmp_path, "w");
+    if (f == NULL) {
+        chilog_ratelimited(LOG_GENERAL, WARNING, "Could not write metrics file %s", tmp_path);
+        return -1;
+    }
+
+    fprintf(f, "# HELP chirc_delivery_latency_seconds Time from kernel receive to write completion.\n");
+    fprintf(f, "# TYPE chirc_delivery_latency_seconds histogram\n");
+    for (int path = 0; path < NUM_DELIVERY_PATHS; path++) {
+        snprintf(labels, sizeof(labels), "path=\"%s\"", delivery_path_names[path]);
+        histogram_write(f, "chirc_delivery_latency_seconds", labels, &delivery_latency[path]);
+    }
+
+    fprintf(f, "# HELP chirc_output_flushes_total Number of output buffer flushes.\n");
+    fprintf(f, "# TYPE chirc_output_flushes_total counter\n");
+    fprintf(f, "chirc_output_flushes_total %lu\n", atomic_load_explicit(&flush_count, memory_order_relaxed));
+    fprintf(f, "# HELP chirc_output_flushed_bytes_total Number of bytes written by output buffer flushes.\n");
+    fprintf(f, "# TYPE chirc_output_flushed_bytes_total counter\n");
+    fprintf(f, "chirc_output_flushed_bytes_total %lu\n", atomic_load_explicit(&flush_bytes, memory_order_relaxed));
+    fprintf(f, "# HELP chirc_output_coalesce_window_seconds Coalescing window in effect at each flush.\n");
+    fprintf(f, "# TYPE chirc_output_coalesce_window_seconds histogram\n");
+    histogram_write(f, "chirc_output_coalesce_window_seconds", "conn=\"client\"", &coalesce_window);
+
+    if (fclose(f) != 0 || rename(tmp_path, path) == -1) {
+        chilog_ratelimited(LOG_GENERAL, WARNING, "Could not write metrics file %s", path);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ *
+ *  chirc: a simple multi-threaded IRC server
+ *
+ *  Server statistics
+ *
+ *  Counters and histograms that can be updated from any thread without
+ *  locking, and periodically exported to a metrics file in the
+ *  Prometheus text format.
+ *
+ */
+
+#ifndef CHIRC_STATS_H_
+#define CHIRC_STATS_H_
+
+#include <stddef.h>
+#include <time.h>
+
+/* Latency histogram buckets are powers of two microseconds, from 1us
+ * up to 2^(LATENCY_BUCKETS - 1) us (about 16s), plus an overflow bucket */
+#define LATENCY_BUCKETS (25)
+
+/* How often the metrics file is rewritten, in seconds */
+#define METRICS_INTERVAL (10)
+
+/* How a message reached its recipient */
+typedef enum {
+    DELIVERY_LOCAL   = 0,   /* Sender and recipient are on this server */
+    DELIVERY_RELAYED = 1,   /* Message arrived through a server link */
+    NUM_DELIVERY_PATHS
+} delivery_path_t;
+
+
+/*
+ * stats_record_delivery - Records the end-to-end latency of a delivery
+ *
+ * Should be called once the reply or message has been written to the
+ * recipient's socket.
+ *
+ * path: How the message reached the recipient
+ *
+ * rx_time: When the kernel received the line that caused the delivery
+ *          (CLOCK_REALTIME)
+ *
+ * Returns: Nothing.
+ */
+void stats_record_delivery(delivery_path_t path, const struct timespec *rx_time);
+
+
+/*
+ * stats_record_flush - Records a flush of a connection's output buffer
+ *
+ * bytes: Number of bytes written by the flush
+ *
+ * window_us: Coalescing window in effect for the connection, in
+ *            microseconds (0 if output is flushed immediately)
+ *
+ * Returns: Nothing.
+ */
+void stats_record_flush(size_t bytes, long window_us);
+
+
+/*
+ * stats_write_metrics - Writes all statistics to a file
+ *
+ * The file is written to a temporary file first and then renamed, so
+ * readers never see a partially written file.
+ *
+ * path: Path of the metrics file
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int stats_write_metrics(const char *path);
+
+
+#endif /* CHIRC_STATS_H_ */
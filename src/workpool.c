@@ -0,0 +1,129 @@
+/*
+ *  chirc: a simple multi-threaded IRC server
+ *
+ *  Worker pool
+ *
+ *  see workpool.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "workpool.h"
+#include "log.h"
+
+typedef struct work_item {
+    work_fn fn;
+    void *arg;
+    struct work_item *next;
+} work_item;
+
+struct workpool {
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    work_item *queue_head, *queue_tail;     /* Jobs waiting for a thread */
+    work_item *done;                        /* Completed jobs */
+    int in_flight;
+    int max_in_flight;
+    int notify_fd;
+};
+
+static void *worker(void *ptr)
+{
+    workpool *pool = (workpool *) ptr;
+
+    chirc_logthread_dedicated();
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->queue_head == NULL)
+            pthread_cond_wait(&pool->available, &pool->lock);
+
+        work_item *item = pool->queue_head;
+        pool->queue_head = item->next;
+        if (pool->queue_head == NULL)
+            pool->queue_tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        item->fn(item->arg);
+
+        pthread_mutex_lock(&pool->lock);
+        item->next = pool->done;
+        pool->done = item;
+        uint64_t one = 1;
+        write(pool->notify_fd, &one, sizeof(one));
+    }
+    return NULL;
+}
+
+workpool *workpool_create(int num_threads, int max_in_flight)
+{
+    workpool *pool = calloc(1, sizeof(workpool));
+
+    pool->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->notify_fd == -1) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->available, NULL);
+    pool->max_in_flight = max_in_flight;
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, worker, pool);
+        pthread_detach(thread);
+    }
+    return pool;
+}
+
+int workpool_submit(workpool *pool, work_fn fn, void *arg)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->in_flight >= pool->max_in_flight) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    pool->in_flight++;
+
+    work_item *item = malloc(sizeof(work_item));
+    item->fn = fn;
+    item->arg = arg;
+    item->next = NULL;
+    if (pool->queue_tail == NULL)
+        pool->queue_head = item;
+    else
+        pool->queue_tail->next = item;
+    pool->queue_tail = item;
+
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+int workpool_notify_fd(workpool *pool)
+{
+    return pool->notify_fd;
+}
+
+void *workpool_take_done(workpool *pool)
+{
+    uint64_t count;
+    void *arg = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    work_item *item = pool->done;
+    if (item != NULL) {
+        pool->done = item->next;
+        pool->in_flight--;
+        arg = item->arg;
+        free(item);
+    } else {
+        read(pool->notify_fd, &count, sizeof(count));
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return arg;
+}
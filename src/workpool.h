@@ -0,0 +1,71 @@
+/*
+ *
+ *  chirc: a simple multi-threaded IRC server
+ *
+ *  Worker pool
+ *
+ *  A fixed number of threads that run slow jobs (e.g. password hashing)
+ *  so that the thread that submits them does not block. The number of
+ *  jobs in flight (queued or running) is bounded, so a flood of
+ *  requests can only ever queue a bounded amount of work.
+ *
+ *  Completed jobs are handed back to the submitting thread: it polls
+ *  the pool's notification file descriptor, and collects them with
+ *  workpool_take_done().
+ *
+ */
+
+#ifndef CHIRC_WORKPOOL_H_
+#define CHIRC_WORKPOOL_H_
+
+typedef void (*work_fn)(void *arg);
+
+typedef struct workpool workpool;
+
+
+/*
+ * workpool_create - Creates a worker pool and starts its threads
+ *
+ * num_threads: Number of worker threads
+ *
+ * max_in_flight: Maximum number of jobs queued or running at once
+ *
+ * Returns: the pool, or NULL on error.
+ */
+workpool *workpool_create(int num_threads, int max_in_flight);
+
+
+/*
+ * workpool_submit - Queues a job
+ *
+ * pool: The pool
+ *
+ * fn: Function that runs the job on a worker thread
+ *
+ * arg: Argument of fn. Returned by workpool_take_done() once fn is done.
+ *
+ * Returns: 0 on success, -1 if max_in_flight jobs are already in flight.
+ */
+int workpool_submit(workpool *pool, work_fn fn, void *arg);
+
+
+/*
+ * workpool_notify_fd - Returns the pool's notification file descriptor
+ *
+ * The descriptor is readable when completed jobs are waiting to be
+ * collected. workpool_take_done() clears it.
+ */
+int workpool_notify_fd(workpool *pool);
+
+
+/*
+ * workpool_take_done - Collects a completed job
+ *
+ * pool: The pool
+ *
+ * Returns: the arg of a completed job, or NULL if there are none.
+ */
+void *workpool_take_done(workpool *pool);
+
+
+#endif /* CHIRC_WORKPOOL_H_ */